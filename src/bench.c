@@ -0,0 +1,414 @@
+// Windowless benchmarks for the analysis and UI hot paths.
+// plug.c is compiled into this file, so its static functions can be called directly.
+
+// Without a window raylib has no default font and MeasureText() always returns 0,
+// approximate it with a fixed advance per character instead
+#define MeasureText bench_measure_text
+
+#include "plug.c"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#define BENCH_SAMPLES 15
+#define BENCH_MIN_SAMPLES 3
+#define BENCH_SAMPLE_NS 20000000ull     // Each sample runs the op for at least this long
+#define BENCH_BUDGET_NS 10000000000ull  // Slow ops take fewer samples to stay within this
+#define BENCH_JSON_FILEPATH "./bench.json"
+#define BENCH_PFFT_MIN_SIZE (1 << 16)
+#define BENCH_PFFT_MAX_SIZE (1 << 18)
+#define BENCH_SHARING_ITERS 20000000
+
+typedef void(BenchFn)(size_t n);
+
+typedef struct {
+    const char* name;
+    BenchFn* fn;
+    size_t n;
+} Bench;
+
+typedef struct {
+    const char* name;
+    size_t n;
+    uint64_t iters;
+    size_t samples;
+    double median;
+    double mean;
+    double stddev;
+    double min;
+    double max;
+} BenchResult;
+
+// Results of pure functions go here, so the compiler cannot drop the calls
+static volatile size_t bench_sink = 0;
+
+static FftPool bench_pool = {0};
+static float bench_pfft_in[BENCH_PFFT_MAX_SIZE];
+static float complex bench_pfft_out[BENCH_PFFT_MAX_SIZE];
+
+// What the audio callback and the analysis thread write for every buffer and every spectrum
+typedef struct {
+    _Atomic size_t* in_hold;
+    _Atomic uint64_t* in_pos;
+    volatile uint64_t* out_pos;
+    volatile size_t* freq_count;
+    pthread_barrier_t start;
+    bool pinned;
+} BenchSharing;
+
+// Those fields as they sat next to each other before the Plug was split into per-thread blocks
+typedef struct {
+    _Atomic size_t in_hold;
+    _Atomic uint64_t in_pos;
+    uint64_t out_pos;
+    size_t freq_count;
+} BenchPacked;
+
+static char* bench_paths = NULL;
+static size_t bench_path_size = 0;
+
+int bench_measure_text(const char* text, int font_size) {
+    int width = 0;
+    for (const char* c = text; *c != '\0'; ++c) width += font_size / 2 + 1;
+    return width;
+}
+
+static const char* bench_path(size_t i) {
+    return bench_paths + i * bench_path_size;
+}
+
+static void bench_paths_init(size_t count) {
+    bench_path_size = 64;
+    da_malloc(bench_paths, count * bench_path_size);
+    for (size_t i = 0; i < count; ++i) {
+        snprintf(bench_paths + i * bench_path_size, bench_path_size, "/home/user/Music/artist_%04zu/album/track_%06zu.mp3", i % 1000, i);
+    }
+}
+
+static void bench_tracks_reset(void) {
+    tracks_free(&p->tracks);
+    da_free(&p->shuffle.order);
+    da_free(&p->shuffle.pos);
+    memset(&p->tracks, 0, sizeof(p->tracks));
+    memset(&p->shuffle, 0, sizeof(p->shuffle));
+}
+
+// What load_tracks() does for every dropped file, minus decoding
+static void bench_tracks_import(size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        if (track_exists(bench_path(i))) continue;
+        tracks_push(&p->tracks, (Music){0}, bench_path(i), NULL, 0);
+        shuffle_add(&p->shuffle);
+    }
+}
+
+/* Benchmarks */
+static void bench_fft(size_t n) {
+    fft(p->analysis->in_windowed, 1, p->analysis->out_raw, n);
+}
+
+// n is the Engine
+static void bench_fft_proccess(size_t n) {
+    atomic_store(&p->audio->engine, n);
+    fft_proccess(1.0f / 60.0f);
+    atomic_store(&p->audio->engine, ENGINE_FFT);
+}
+
+static void bench_fft_push(size_t n) {
+    static float frames[AUDIO_STREAM_BUFFER_FRAMES];
+    fft_push(frames, n);
+}
+
+// What the sliding DFT adds to every pushed block
+static void bench_sdft_push(size_t n) {
+    static float frames[AUDIO_STREAM_BUFFER_FRAMES];
+    sdft_push(&p->audio->sdft, frames, n);
+}
+
+static void bench_callback(size_t n) {
+    static float frames[AUDIO_STREAM_BUFFER_FRAMES][2];
+    callback(frames, n);
+}
+
+// Same callback on a 96 kHz stream, which goes through the polyphase resampler
+static void bench_callback_96k(size_t n) {
+    static float frames[AUDIO_STREAM_BUFFER_FRAMES][2];
+    atomic_store(&p->audio->rate, 96000);
+    callback(frames, n);
+    atomic_store(&p->audio->rate, 44100);
+}
+
+static void bench_pfft(size_t n) {
+    pfft(&bench_pool, bench_pfft_in, bench_pfft_out, n);
+}
+
+static void bench_track_exists(size_t n) {
+    static size_t loaded = 0;
+    if (loaded != n) {
+        bench_tracks_reset();
+        bench_tracks_import(n);
+        loaded = n;
+    }
+    bench_sink += track_exists("/home/user/Music/not/in/the/playlist.mp3");
+}
+
+static void bench_import(size_t n) {
+    bench_tracks_reset();
+    bench_tracks_import(n);
+}
+
+static void bench_str_fit_width(size_t n) {
+    char text[128];
+    memcpy(text, bench_path(n), bench_path_size);
+    str_fit_width(text, HUD_POPUP_WIDTH, HUD_POPUP_FONT_SIZE, HUD_POPUP_PAD);
+    bench_sink += strlen(text);
+}
+
+static Bench benches[] = {
+    {"fft", bench_fft, FFT_SIZE},
+    {"fft_proccess", bench_fft_proccess, ENGINE_FFT},
+    {"fft_proccess", bench_fft_proccess, ENGINE_MULTIRES},
+    {"fft_proccess", bench_fft_proccess, ENGINE_SDFT},
+    {"fft_push", bench_fft_push, 1},
+    {"fft_push", bench_fft_push, AUDIO_STREAM_BUFFER_FRAMES},
+    {"sdft_push", bench_sdft_push, 64},
+    {"sdft_push", bench_sdft_push, 256},
+    {"callback", bench_callback, 512},
+    {"callback", bench_callback, AUDIO_STREAM_BUFFER_FRAMES},
+    {"callback_96k", bench_callback_96k, 512},
+    {"callback_96k", bench_callback_96k, AUDIO_STREAM_BUFFER_FRAMES},
+    {"track_exists", bench_track_exists, 1000},
+    {"track_exists", bench_track_exists, 10000},
+    {"track_exists", bench_track_exists, 100000},
+    {"import", bench_import, 1000},
+    {"import", bench_import, 10000},
+    {"import", bench_import, 100000},
+    {"str_fit_width", bench_str_fit_width, 0},
+};
+
+/* Runner */
+static int double_cmp(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static BenchResult bench_run(const Bench* b) {
+    BenchResult r = {.name = b->name, .n = b->n};
+
+    // Warm up and find out how many iterations fill one sample, slow ops are not run twice for that
+    uint64_t start = time_now_ns();
+    b->fn(b->n);
+    uint64_t once = time_now_ns() - start;
+    if (once < BENCH_SAMPLE_NS) {
+        start = time_now_ns();
+        b->fn(b->n);
+        once = time_now_ns() - start;
+    }
+    if (once == 0) once = 1;
+
+    r.iters = BENCH_SAMPLE_NS / once;
+    if (r.iters == 0) r.iters = 1;
+    r.samples = BENCH_SAMPLES;
+    while (r.samples > BENCH_MIN_SAMPLES && r.samples * r.iters * once > BENCH_BUDGET_NS) r.samples -= 1;
+
+    double ns[BENCH_SAMPLES];
+    for (size_t s = 0; s < r.samples; ++s) {
+        start = time_now_ns();
+        for (uint64_t i = 0; i < r.iters; ++i) b->fn(b->n);
+        ns[s] = (double)(time_now_ns() - start) / r.iters;
+    }
+
+    qsort(ns, r.samples, sizeof(ns[0]), double_cmp);
+    r.median = ns[r.samples / 2];
+    r.min = ns[0];
+    r.max = ns[r.samples - 1];
+    for (size_t s = 0; s < r.samples; ++s) r.mean += ns[s];
+    r.mean /= r.samples;
+    for (size_t s = 0; s < r.samples; ++s) r.stddev += (ns[s] - r.mean) * (ns[s] - r.mean);
+    r.stddev = sqrt(r.stddev / r.samples);
+
+    return r;
+}
+
+// Powers of two, then max itself
+static size_t bench_next_threads(size_t threads, size_t max) {
+    if (threads == max) return max + 1;
+    return threads * 2 < max ? threads * 2 : max;
+}
+
+// One large transform against a single thread, for every power of two thread count up to the cores and the cores.
+// A single thread is plain fft(), so the speedup includes what the four steps do for the cache
+static void bench_pfft_scaling(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t max_threads = cores > 0 ? (size_t)cores : 1;
+    for (size_t i = 0; i < BENCH_PFFT_MAX_SIZE; ++i) bench_pfft_in[i] = (float)rand() / RAND_MAX - 0.5f;
+
+    printf("\n%-16s %8s %8s %14s %8s\n", "pfft", "n", "threads", "ns/op", "speedup");
+    for (size_t n = BENCH_PFFT_MIN_SIZE; n <= BENCH_PFFT_MAX_SIZE; n *= 2) {
+        double single = 0.0;
+        for (size_t threads = 1; threads <= max_threads; threads = bench_next_threads(threads, max_threads)) {
+            pfft_pool_init(&bench_pool, threads, n);
+            BenchResult r = bench_run(&(Bench){"pfft", bench_pfft, n});
+            pfft_pool_free(&bench_pool);
+
+            if (threads == 1) single = r.median;
+            printf("%-16s %8zu %8zu %14.1f %8.2f\n", r.name, n, threads, r.median, r.median > 0 ? single / r.median : 0.0);
+        }
+    }
+}
+
+// Counts the L1 data cache misses of this thread and of the threads it starts from now on, -1 when the kernel does
+// not let it
+static int bench_perf_open(void) {
+    struct perf_event_attr attr = {0};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_L1D;
+    attr.config |= PERF_COUNT_HW_CACHE_OP_READ << 8;
+    attr.config |= PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void bench_sharing_pin(BenchSharing* s, int cpu) {
+    if (!s->pinned) return;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+static void* bench_sharing_audio(void* arg) {
+    BenchSharing* s = arg;
+    bench_sharing_pin(s, 0);
+    pthread_barrier_wait(&s->start);
+    for (size_t i = 0; i < BENCH_SHARING_ITERS; ++i) {
+        atomic_store_explicit(s->in_hold, i, memory_order_relaxed);
+        atomic_fetch_add_explicit(s->in_pos, 1, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+static void* bench_sharing_analysis(void* arg) {
+    BenchSharing* s = arg;
+    bench_sharing_pin(s, 1);
+    pthread_barrier_wait(&s->start);
+    for (size_t i = 0; i < BENCH_SHARING_ITERS; ++i) {
+        *s->out_pos = i;
+        *s->freq_count = i;
+    }
+    return NULL;
+}
+
+// The callback and the analysis thread hammering their own fields on two cores, once with the fields on shared cache
+// lines and once where the blocks put them. Every miss on top of what the blocks take is a line the other core stole
+static void bench_false_sharing(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    static BenchPacked packed;
+    BenchSharing layouts[] = {
+        {
+            .in_hold = &packed.in_hold,
+            .in_pos = &packed.in_pos,
+            .out_pos = &packed.out_pos,
+            .freq_count = &packed.freq_count,
+        },
+        {
+            .in_hold = &p->audio->in_hold,
+            .in_pos = &p->audio->in_pos,
+            .out_pos = &p->analysis->out_pos,
+            .freq_count = &p->analysis->freq_count,
+        },
+    };
+    const char* names[ARRAY_LEN(layouts)] = {"packed", "blocks"};
+
+    printf("\n%-16s %8s %14s %14s\n", "false_sharing", "layout", "ns/op", "l1d_miss/op");
+    for (size_t i = 0; i < ARRAY_LEN(layouts); ++i) {
+        BenchSharing* s = &layouts[i];
+        s->pinned = cores >= 2;
+        pthread_barrier_init(&s->start, NULL, 3);
+
+        int perf = bench_perf_open();
+        if (perf >= 0) ioctl(perf, PERF_EVENT_IOC_ENABLE, 0);
+        pthread_t audio, analysis;
+        pthread_create(&audio, NULL, bench_sharing_audio, s);
+        pthread_create(&analysis, NULL, bench_sharing_analysis, s);
+        pthread_barrier_wait(&s->start);
+        uint64_t start = time_now_ns();
+        pthread_join(audio, NULL);
+        pthread_join(analysis, NULL);
+        double ns = (double)(time_now_ns() - start) / BENCH_SHARING_ITERS;
+
+        uint64_t misses = 0;
+        if (perf >= 0) {
+            ioctl(perf, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(perf, &misses, sizeof(misses)) != sizeof(misses)) misses = 0;
+            close(perf);
+            printf("%-16s %8s %14.2f %14.3f\n", "false_sharing", names[i], ns, (double)misses / BENCH_SHARING_ITERS);
+        } else {
+            printf("%-16s %8s %14.2f %14s\n", "false_sharing", names[i], ns, "n/a");
+        }
+        pthread_barrier_destroy(&s->start);
+    }
+    if (cores < 2) printf("INFO: One core online, both threads share its cache and the layouts perform alike\n");
+}
+
+static bool bench_write_json(const char* file_path, const BenchResult* rs, size_t count) {
+    FILE* f = fopen(file_path, "w");
+    if (f == NULL) return false;
+
+    fprintf(f, "{\n  \"fft_size\": %d,\n  \"benchmarks\": [\n", FFT_SIZE);
+    for (size_t i = 0; i < count; ++i) {
+        const BenchResult* r = &rs[i];
+        fprintf(f, "    {\"name\": \"%s\", \"n\": %zu, \"iterations\": %lu, \"samples\": %zu, "
+                   "\"ns_per_op\": %.1f, \"mean\": %.1f, \"stddev\": %.1f, \"min\": %.1f, \"max\": %.1f}%s\n",
+                r->name, r->n, (unsigned long)r->iters, r->samples, r->median, r->mean, r->stddev, r->min, r->max,
+                i + 1 < count ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    fclose(f);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    const char* json_path = argc > 1 ? argv[1] : BENCH_JSON_FILEPATH;
+
+    SetTraceLogLevel(LOG_WARNING);
+    srand(0);
+
+    plug_init_state();
+    atomic_store(&p->audio->rate, 44100);
+    for (size_t i = 0; i < FFT_SIZE; ++i) {
+        p->audio->in_raw[i] = sinf(TWO_PI * 440.0f * i / 44100.0f) + (float)rand() / RAND_MAX * 0.1f;
+        p->analysis->in_windowed[i] = p->audio->in_raw[i] * p->analysis->hann[i];
+    }
+    bench_paths_init(100000);
+
+    size_t count = ARRAY_LEN(benches);
+    BenchResult results[ARRAY_LEN(benches)];
+
+    printf("%-16s %8s %14s %12s %8s %8s\n", "benchmark", "n", "ns/op", "stddev", "cv%", "samples");
+    for (size_t i = 0; i < count; ++i) {
+        results[i] = bench_run(&benches[i]);
+        BenchResult* r = &results[i];
+        printf("%-16s %8zu %14.1f %12.1f %8.2f %8zu\n", r->name, r->n, r->median, r->stddev,
+               r->mean > 0 ? r->stddev / r->mean * 100.0 : 0.0, r->samples);
+    }
+
+    bench_pfft_scaling();
+    bench_false_sharing();
+
+    if (!bench_write_json(json_path, results, count)) {
+        fprintf(stderr, "ERROR: Could not write %s\n", json_path);
+        return 1;
+    }
+    printf("INFO: Results saved to %s\n", json_path);
+
+    bench_tracks_reset();
+    FREE(bench_paths);
+    return 0;
+}
@@ -20,9 +20,11 @@ static inline void content_swap(void* a, void* b, size_t size) {
 }
 
 #define ASSERT assert
+#ifndef MALLOC
 #define REALLOC realloc
 #define FREE free
 #define MALLOC malloc
+#endif
 
 // Initial capacity of a dynamic array
 #define DA_INIT_CAP 256
@@ -44,27 +46,17 @@ static inline void content_swap(void* a, void* b, size_t size) {
         (da)->items[(da)->count++] = (item);                                           \
     } while (0)
 
-// Shuffle a dynamic array
-#define da_shuffle(da, from, safe)                                          \
-    do {                                                                    \
-        for (size_t i = 0; i < (da)->count - 1; i++) {                      \
-            if (i >= (size_t)(from)) {                                      \
-                int j = rand_in_in_range(i, (da)->count);                   \
-                ptr_swap((void**)&(da)->items[i], (void**)&(da)->items[j]); \
-                da_append((safe), j);                                       \
-            } else {                                                        \
-                da_append((safe), i);                                       \
-            }                                                               \
-        }                                                                   \
-    } while (0)
-
-// Unshuffle a dynamic array
-#define da_unshuffle(da, safe)                                          \
-    do {                                                                \
-        for (int i = count - 2; i >= 0; i--) {                          \
-            int j = (safe)[i];                                          \
-            ptr_swap((void**)&(da)->items[i], (void**)&(da)->items[j]); \
-        }                                                               \
+// Append several items to a dynamic array
+#define da_append_many(da, new_items, new_items_count)                                              \
+    do {                                                                                            \
+        if ((da)->count + (new_items_count) > (da)->capacity) {                                     \
+            if ((da)->capacity == 0) (da)->capacity = DA_INIT_CAP;                                  \
+            while ((da)->count + (new_items_count) > (da)->capacity) (da)->capacity *= 2;           \
+            (da)->items = REALLOC((da)->items, (da)->capacity * sizeof(*(da)->items));              \
+            ASSERT((da)->items != NULL && "ERROR: Not enough RAM");                                 \
+        }                                                                                           \
+        memcpy((da)->items + (da)->count, (new_items), (new_items_count) * sizeof(*(da)->items));   \
+        (da)->count += (new_items_count);                                                           \
     } while (0)
 
 // Allocate a dynamic array
@@ -82,6 +74,40 @@ static inline void content_swap(void* a, void* b, size_t size) {
         memset((arr), 0, (count) * sizeof(*(arr)));       \
     } while (0)
 
+// Bump allocator over a fixed buffer, everything is released at once by arena_reset
+typedef struct {
+    char* items;
+    size_t count;
+    size_t capacity;
+} Arena;
+
+static inline void* arena_alloc(Arena* a, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    ASSERT(a->count + size <= a->capacity && "ERROR: Arena is full");
+    void* ptr = a->items + a->count;
+    a->count += size;
+    return ptr;
+}
+
+static inline void arena_reset(Arena* a) {
+    a->count = 0;
+}
+
+// Like TextFormat, but the string stays valid until the arena is reset
+static inline char* arena_sprintf(Arena* a, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    ASSERT(n >= 0);
+
+    char* str = arena_alloc(a, n + 1);
+    va_start(args, fmt);
+    vsnprintf(str, n + 1, fmt, args);
+    va_end(args);
+    return str;
+}
+
 // Remove an item by index from a dynamic array
 #define da_remove(da, id)                                                                                       \
     do {                                                                                                        \
@@ -147,6 +173,58 @@ float slider_get_value(float y, float hiy, float loy) {
     return y;
 }
 
+// Map a whole file read-only into memory, returns NULL on failure
+static inline unsigned char* file_map(const char* file_path, size_t* size) {
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+
+    *size = st.st_size;
+    return data;
+}
+
+// Compare two floats, for qsort
+static inline int float_cmp(const void* a, const void* b) {
+    float x = *(const float*)a;
+    float y = *(const float*)b;
+    return (x > y) - (x < y);
+}
+
+// Get the monotonic clock time in seconds
+static inline double time_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Get the monotonic clock time in nanoseconds
+static inline uint64_t time_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Raise an atomic counter to at least a value
+static inline void atomic_max_u64(_Atomic uint64_t* target, uint64_t value) {
+    uint64_t cur = atomic_load_explicit(target, memory_order_relaxed);
+    while (value > cur && !atomic_compare_exchange_weak_explicit(target, &cur, value, memory_order_relaxed, memory_order_relaxed));
+}
+
+// Suspend the calling thread for a number of seconds
+static inline void time_sleep(double secs) {
+    struct timespec ts = {.tv_sec = (time_t)secs, .tv_nsec = (long)((secs - (time_t)secs) * 1e9)};
+    nanosleep(&ts, NULL);
+}
+
 #define DJB2_INIT 5381
 
 // DJB2 hash function
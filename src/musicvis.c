@@ -2,6 +2,7 @@
 #include <raylib.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include "plug.h"
@@ -52,12 +53,24 @@ void clean_libplug(void) {
 }
 #else
 #define reload_libplug() true
-#define clean_libplug() 0
+#define clean_libplug() (void)0
 #endif
 
-int main(void) {
+int main(int argc, char** argv) {
     if (!reload_libplug()) return 1;
 
+    // Windowless modes, they never touch the window or the audio device
+    if (argc > 1 && strcmp(argv[1], "--analyze") == 0) {
+        int ret = plug_analyze(argc - 2, argv + 2);
+        clean_libplug();
+        return ret;
+    }
+    if (argc > 1 && strcmp(argv[1], "--render") == 0) {
+        int ret = plug_render(argc - 2, argv + 2);
+        clean_libplug();
+        return ret;
+    }
+
     Image logo = LoadImage(LOGO_FILEPATH);
 
     SetConfigFlags(FLAG_WINDOW_RESIZABLE);
@@ -65,7 +78,6 @@ int main(void) {
     SetTargetFPS(60);
     SetWindowIcon(logo);
     SetExitKey(KEY_NULL);
-    InitAudioDevice();
     SetRandomSeed(time(NULL));
 
     plug_init();
@@ -83,7 +95,6 @@ int main(void) {
     clean_libplug();
 
     UnloadImage(logo);
-    CloseAudioDevice();
     CloseWindow();
     return 0;
 }
\ No newline at end of file
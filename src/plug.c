@@ -1,20 +1,44 @@
+#define _GNU_SOURCE  // pthread_setaffinity_np() and gettid()
 #include "plug.h"
 
 #include <assert.h>
 #include <complex.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <math.h>
 #include <pthread.h>
 #include <raylib.h>
 #include <raymath.h>
 #include <rlgl.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Every allocation goes through the Memory Accounting section, tagged by the section it is made from
+#define MALLOC(size) mem_malloc(MEM_TAG, (size))
+#define REALLOC(ptr, size) mem_realloc(MEM_TAG, (ptr), (size))
+#define FREE(ptr) mem_free(ptr)
+#define MEM_TAG MEM_PLUG
 
 #include "helpers.h"
+#include "shm.h"
 
 /* Types */
+// Data that different threads write is kept a cache line apart, so their writes do not invalidate each other
+#define CACHE_LINE 64
+
 typedef enum {
     CIRCLE_FRAGMENT = 0,
     COUNT_FRAGMENTS
@@ -50,19 +74,46 @@ typedef enum {
 } UIState;
 
 typedef struct {
-    char* file_path;
-    Music music;
-} Track;
+    size_t path;               // Offset of the file path in the paths arena
+    unsigned char* file_data;  // Memory-mapped file contents, NULL when streamed through stdio
+    size_t file_size;
+} TrackFile;
+
+typedef struct {
+    char* items;
+    size_t count;
+    size_t capacity;
+} Chars;
 
+// Playlist storage, tracks live in stable slots and the playlist order is a separate index array
 typedef struct {
-    Track* items;
+    Music* music;      // Hot: indexed by slot
+    TrackFile* files;  // Cold: indexed by slot
+    uint32_t* order;   // Playlist position -> slot
+    uint32_t* where;   // Slot -> playlist position
     size_t count;
     size_t capacity;
+    Chars paths;         // Arena with every file path, zero-terminated
+    size_t paths_waste;  // Bytes of the arena held by removed tracks
 } Tracks;
 
 typedef struct {
-    const char* key;
+    size_t* items;
+    size_t count;
+    size_t capacity;
+} Indices;
+
+typedef struct {
+    Indices order;  // Play order, a permutation of track slots
+    Indices pos;    // Inverse permutation, track slot -> position in the play order
+    size_t cursor;  // Position of the current track
+    size_t drawn;   // Positions below are fixed, the rest is a pool to draw from
+} Shuffle;
+
+typedef struct {
+    char* key;  // Owned, the path the caller passed may live in a library that gets reloaded
     Image value;
+    long mtime;  // Of the file when it was loaded
 } ImageItem;
 
 typedef struct {
@@ -72,8 +123,9 @@ typedef struct {
 } Images;
 
 typedef struct {
-    const char* key;
+    char* key;  // Owned, like ImageItem
     Texture2D value;
+    long mtime;
 } TextureItem;
 
 typedef struct {
@@ -87,10 +139,12 @@ typedef struct {
     Textures textures;
 } Assets;
 
+#define POPUP_HEADER_CAPACITY 64
+#define POPUP_MSG_CAPACITY 128
 typedef struct {
     float lifetime;
-    char* header;
-    char* msg;
+    char header[POPUP_HEADER_CAPACITY];
+    char msg[POPUP_MSG_CAPACITY];
 } Popup;
 
 #define POPUP_CAPACITY 15
@@ -104,11 +158,450 @@ typedef struct {
     float slide;
 } Popups;
 
+typedef enum {
+    PROF_FRAME = 0,
+    PROF_INPUT,
+    PROF_FFT_RENDER,
+    PROF_POPUPS_RENDER,
+    PROF_TRACKS_PANEL_RENDER,
+    PROF_TIMELINE_RENDER,
+    PROF_END_DRAWING,
+    PROF_UPDATE_MUSIC,
+    PROF_FFT_WINDOW,
+    PROF_FFT_TRANSFORM,
+    PROF_FFT_REDUCE,
+    PROF_FFT_PUBLISH,
+    COUNT_PROF_STAGES
+} ProfStage;
+
+#define PROF_RING_CAPACITY 512
+typedef struct {
+    _Alignas(CACHE_LINE) float items[PROF_RING_CAPACITY];  // Stage durations in milliseconds
+    size_t count;                     // Total number of recorded samples
+    double start;
+    uint32_t start_epoch;  // Profiler epoch when start was taken
+} ProfRing;
+
+// Every ring is written by the single thread that runs its stage
+typedef struct {
+    _Atomic bool enabled;
+    _Atomic uint32_t epoch;  // Bumped on every toggle, a stage that began in an earlier epoch is not recorded
+    ProfRing rings[COUNT_PROF_STAGES];
+} Profiler;
+
+// Audio device thread statistics, updated lock-free from callback() and the feeder
+typedef struct {
+    _Atomic uint64_t calls;
+    _Atomic uint64_t total_ns;
+    _Atomic uint64_t max_ns;
+    _Atomic uint64_t over_budget;
+    // Feeder passes that came more than a sub-buffer after the previous one. The device may still have had the
+    // other half queued, raylib does not tell whether it really ran dry
+    _Atomic uint64_t late_refills;
+} AudioStats;
+
+// Lag between what is heard and what is drawn, sampled once per rendered frame
+typedef struct {
+    bool enabled;
+    bool click_high;
+    ProfRing lag;        // Playback position minus the position of the spectrum on screen, ms
+    ProfRing click_lag;  // Playback position when a click shows up minus the position of that click, ms
+} Latency;
+
+typedef enum {
+    TRACE_RENDER,
+    TRACE_ANALYSIS,
+    TRACE_AUDIO,
+    TRACE_FEEDER,
+    COUNT_TRACE_THREADS
+} TraceThread;
+
+#define TRACE_CAPACITY (1 << 16)
+typedef struct {
+    const char* name;  // Must be a string literal, it is only read when the trace is written
+    uint64_t ts_ns;
+    float value;
+    char phase;  // 'B', 'E' or 'C' as in the Chrome trace event format
+} TraceEvent;
+
+// Written by a single thread: the event is filled first and then published by bumping count
+typedef struct {
+    _Alignas(CACHE_LINE) TraceEvent* items;
+    _Atomic size_t count;
+    size_t base;  // count at the moment tracing was started
+} TraceBuffer;
+
+typedef struct {
+    _Atomic bool enabled;
+    uint64_t start_ns;
+    TraceBuffer bufs[COUNT_TRACE_THREADS];
+} Tracer;
+
+// Session file: RecHeader and a REC_TRACK for each track, then per frame the REC_AUDIO buffers the callback saw
+// before it, the REC_INPUT that plug_update() read and a REC_FRAME, at the end REC_END
+#define REC_MAGIC "MVR1"
+#define REC_VERSION 3
+typedef enum {
+    REC_AUDIO = 1,  // uint32_t frames, float samples[frames][2]
+    REC_FRAME,      // RecFrame
+    REC_INPUT,      // uint32_t count, AutomationEvent events[count]
+    REC_TRACK,      // uint32_t length, char path[length]
+    REC_END
+} RecType;
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t fft_size;
+    uint32_t sample_rate;
+
+    // The player as the recording found it, replay restores it before the first frame
+    int32_t width;
+    int32_t height;
+    uint32_t track_count;
+    int32_t cur_track;
+    uint32_t engine;
+    uint32_t mode;
+    float volume;
+    bool paused;
+    bool fullscreen;
+} RecHeader;
+
+typedef struct {
+    uint64_t frame;
+    double time;
+    float dt;
+    uint32_t dropped;  // Audio buffers lost so far because the ring was full
+} RecFrame;
+
+#define REC_RING_FRAMES (1 << 18)
+#define REC_RING_BUFFERS 1024
+// The callback produces into the rings and the render thread drains them into the file
+typedef struct {
+    _Atomic bool active;
+    FILE* file;
+    uint64_t frame;
+    float (*samples)[2];
+    uint32_t* sizes;
+    _Atomic size_t samples_head;
+    _Atomic size_t samples_tail;
+    _Atomic size_t sizes_head;
+    _Atomic size_t sizes_tail;
+    _Atomic uint32_t dropped;
+    AutomationEventList events;  // Filled by EndDrawing(), emptied into the file every frame
+} Recorder;
+
+// Band file: AnalyzeHeader, band_count floats with the lower edge of every band in Hz, then frame_count frames
+// of band_count floats. Frame i is the window that ends at sample (i + 1) * hop of the first channel
+#define ANALYZE_MAGIC "MVB1"
+#define ANALYZE_VERSION 1
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t fft_size;
+    uint32_t sample_rate;
+    uint32_t hop;
+    uint32_t band_count;
+    uint64_t frame_count;
+} AnalyzeHeader;
+
+// Shared between the worker processes of --analyze
+typedef struct {
+    _Atomic size_t next;
+    _Atomic size_t failed;
+} AnalyzeQueue;
+
+// The name an input is written under in the -o directory, sorted to find the inputs that would share one
+typedef struct {
+    char* name;
+    size_t file;
+} AnalyzeName;
+
+#define RESAMPLE_TAPS 32          // Per phase, a multiple of RESAMPLE_LANES
+#define RESAMPLE_LANES 8          // Partial sums of the dot product, so it vectorizes without reassociating floats
+#define RESAMPLE_MAX_PHASES 1024  // Enough for every common rate, odd ones round to the nearest lower phase
+#define RESAMPLE_CHUNK 1024       // Input frames converted at once
+#define RESAMPLE_OUT_CAPACITY 8192
+#define RESAMPLE_CUTOFF 0.45f  // Of the lower of the two rates, leaves room for the transition band
+// Polyphase FIR that brings the callback's left channel to ANALYSIS_RATE. The output sits between input
+// samples pos - 1 and pos of x, phase / up of the way, and row phase * phases / up of the bank interpolates it
+typedef struct {
+    unsigned int in_rate;  // Rate the bank was built for, 0 before the first buffer
+    unsigned int up;       // ANALYSIS_RATE / in_rate as the reduced fraction up / down
+    unsigned int down;
+    unsigned int phases;   // up, or RESAMPLE_MAX_PHASES when the fraction would need more rows
+    unsigned int phase;
+    size_t pos;
+    float bank[RESAMPLE_MAX_PHASES][RESAMPLE_TAPS];  // Rows are reversed, so they line up with x
+    float x[RESAMPLE_TAPS - 1 + RESAMPLE_CHUNK];     // History, then the chunk being converted
+    float y[RESAMPLE_OUT_CAPACITY];
+} Resampler;
+
+typedef enum {
+    ENGINE_FFT = 0,   // One FFT_SIZE window for every band
+    ENGINE_MULTIRES,  // Short windows for the highs, long ones for the lows
+    ENGINE_SDFT,      // Sliding DFT updated with every sample, reading it costs O(bands)
+    COUNT_ENGINES
+} Engine;
+
+// Full FFT bins behind every displayed band, log-spaced from LOW_FREQ with FREQ_STEP
+#define BAND_CAPACITY 1024
+typedef struct {
+    size_t count;
+    uint32_t lo[BAND_CAPACITY];  // First bin
+    uint32_t hi[BAND_CAPACITY];  // One past the last bin
+} BandMap;
+
+// Level k transforms the newest MR_SIZE samples of the input decimated k times by 2, so its window is 2^k times
+// longer and its bins 2^k times narrower than level 0's. Every band reads the shortest window that resolves it
+#define MR_SIZE 4096
+#define MR_LEVELS 4  // The longest window is MR_SIZE << (MR_LEVELS - 1) samples, as long as FFT_SIZE
+#define MR_HALFBAND_TAPS 31
+typedef struct {
+    float hann[MR_SIZE];
+    float halfband[MR_HALFBAND_TAPS];
+    float gain;                             // Brings the shorter windows to the level of one FFT_SIZE window
+    float dec[MR_SIZE << (MR_LEVELS - 1)];  // Decimated input of the levels from 1 up, each half as long as the previous
+    uint8_t level[BAND_CAPACITY];
+} MultiRes;
+
+// Damped sliding DFT resonators, only for the bins the bands read. Group g slides a window of FFT_SIZE >> g samples,
+// its resonators are start[g] up to start[g + 1] sorted by bin, so the Hann neighbours of a bin sit right next to it
+#define SDFT_GROUPS 8
+#define SDFT_CAPACITY 2048
+#define SDFT_REFRESH_HZ 240
+#define SDFT_DAMPING 0.999999f  // Forgets rounding errors within ~20 s, barely changes the window
+typedef struct {
+    uint32_t start[SDFT_GROUPS + 1];
+    float gain[SDFT_GROUPS];  // Brings the shorter windows to the level of one FFT_SIZE window
+    float zr[SDFT_CAPACITY];  // SDFT_DAMPING * e^(-2 pi i k / N)
+    float zi[SDFT_CAPACITY];
+    float zNr[SDFT_CAPACITY];  // z^N, what is left of the sample leaving the window
+    float zNi[SDFT_CAPACITY];
+    float re[SDFT_CAPACITY];  // Written by the audio thread only
+    float im[SDFT_CAPACITY];
+    uint32_t band_res[BAND_CAPACITY];  // Resonator at the center of the band
+    uint64_t filled;                   // Samples since the last reset, older ones were never added
+    atomic_bool reset;                 // Set by any thread, the audio thread clears the state on the next push
+} Sdft;
+
+// Spectrum cache file: SpecHeader, then frame_count frames of band_count bytes, each the normalized band * 255.
+// Frame i is centered on sample i * hop, the position out_pos stamps on the live spectrum
+#define SPEC_MAGIC "MVC1"
+#define SPEC_VERSION 3
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    uint32_t sample_rate;
+    uint32_t hop;
+    uint32_t band_count;
+    uint32_t frame_count;
+} SpecHeader;
+
+// Whole-track spectra analyzed once by a background job and memory-mapped on later plays
+typedef struct {
+    unsigned char* data;  // Cache of the current track, NULL if it has none, guarded by th_mutex
+    size_t size;
+
+    // Only one track is analyzed at a time, spec_job_poll() starts the one playing by then when it finishes
+    pthread_t job;
+    bool job_running;
+    _Atomic bool job_stop;
+    _Atomic bool job_done;
+    uint64_t job_key;
+    float* job_scratch;  // Allocated by spec_job_start(), so that the job never shows up as a steady-state allocation
+    Resampler* job_resampler;
+    char job_path[PATH_MAX];
+    char job_cache[PATH_MAX];
+    bool disabled;  // Set by replay, so that its checksums are of the live analysis whatever is cached
+} SpecCache;
+
+// Waveform overview file: PeaksHeader, then the levels from the finest to the coarsest. A bucket of level k
+// covers base << k frames with the signed byte min and max over all channels, the last level has a single bucket
+#define PEAKS_MAGIC "MVP1"
+#define PEAKS_VERSION 1
+#define PEAKS_MAX_LEVELS 48
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    uint64_t frame_count;
+    uint32_t sample_rate;
+    uint32_t base;
+    uint32_t level_count;
+} PeaksHeader;
+
+// Min/max pyramid of the current track for the timeline, only the render thread reads it
+typedef struct {
+    unsigned char* data;
+    size_t size;
+    const int8_t* levels[PEAKS_MAX_LEVELS];
+    size_t counts[PEAKS_MAX_LEVELS];
+
+    pthread_t job;
+    bool job_running;
+    _Atomic bool job_stop;
+    _Atomic bool job_done;
+    uint64_t job_key;
+    char job_path[PATH_MAX];
+    char job_cache[PATH_MAX];
+} Peaks;
+
+// One primitive of the fft_render() visual in frame pixels, shaded the way circle.fs does it
+typedef struct {
+    Rectangle dest;
+    float v0, v1;         // Texture rows the quad spans, the columns always span 0..1
+    float radius, power;  // circle.fs uniforms, a power of 0 is a plain fill
+    Color c;
+} RenderQuad;
+
+typedef struct {
+    RenderQuad* items;
+    size_t count;
+    size_t capacity;
+} RenderQuads;
+
+// Shared by the render workers, the thread that calls render_frame() is one of them
+typedef struct {
+    int width;
+    int height;
+    unsigned char* pixels;  // RGBA
+    RenderQuads quads;  // RENDER_QUADS_PER_BAND per band, band by band from left to right
+    float cell_width;
+    _Atomic size_t next_tile;
+    bool stop;
+    pthread_barrier_t start;
+    pthread_barrier_t done;
+} Renderer;
+
+typedef enum {
+    SCHED_ROLE_ANALYSIS,    // fft_thread() and the FFT pool
+    SCHED_ROLE_FEEDER,      // audio_feeder_thread()
+    SCHED_ROLE_BACKGROUND,  // Spectrum cache and waveform jobs
+    COUNT_SCHED_ROLES
+} SchedRole;
+
+// Read once at startup from MUSICVIS_<ROLE>_CPUS, _POLICY, _PRIORITY and _NICE, every thread applies its role to itself
+typedef struct {
+    bool loaded;
+    bool pinned;
+    cpu_set_t cpus;
+    int policy;    // SCHED_OTHER, SCHED_FIFO or SCHED_RR
+    int priority;  // Of SCHED_FIFO and SCHED_RR
+    int nice;      // Of SCHED_OTHER, per thread on Linux
+    atomic_bool reported;
+} SchedConfig;
+
+typedef enum {
+    PFFT_TRANSPOSE_IN,  // The n2 x n1 input into n1 rows of n2
+    PFFT_ROWS,          // n2-point FFTs, times the twiddles
+    PFFT_TRANSPOSE_MID,
+    PFFT_COLS,  // n1-point FFTs
+    PFFT_TRANSPOSE_OUT,
+    COUNT_PFFT_STEPS
+} PfftStep;
+
+// Four-step FFT of n = n1 * n2 points split over a pool of workers, the thread that calls pfft() is one of them.
+// Every step hands out tasks through its counter and ends on the step barrier
+typedef struct {
+    size_t threads;  // Including the caller, 0 or 1 means pfft() is plain fft()
+    pthread_t* workers;
+    bool stop;
+    pthread_barrier_t start;
+    pthread_barrier_t step;
+    pthread_barrier_t done;
+    size_t capacity;    // Largest n, the twiddles are its roots of unity
+    float complex* tw;  // e^(-2 pi i j / capacity)
+    float complex* y;
+    float complex* z;
+
+    // Current transform
+    float* in;
+    float complex* out;
+    size_t n;
+    size_t n1;
+    size_t n2;
+    _Atomic size_t next[COUNT_PFFT_STEPS];
+} FftPool;
+
+// A track in a layout every build agrees on
+typedef struct {
+    Music music;
+    const char* path;
+    unsigned char* file_data;  // As in TrackFile
+    size_t file_size;
+} HandoffTrack;
+
+// Bump on every change to Plug or to a type it holds, the state of a build with another version is not adopted
+#define PLUG_STATE_VERSION 5
+// Leads the Plug of every build, fields are only ever appended. A reloaded build that does not recognize the rest of
+// the state still finds here what it needs to take the playback over
+typedef struct {
+    uint32_t version;      // PLUG_STATE_VERSION of the build that allocated the state
+    uint32_t size;         // sizeof(Plug) of that build, catches a layout change nobody bumped the version for
+    HandoffTrack* tracks;  // Playlist order, filled by plug_pre_reload() with plain malloc()
+    size_t track_count;
+    int cur_track;
+    bool paused;
+    float volume;
+    uint64_t reload_ns;  // plug_pre_reload() started
+    uint64_t swap_ns;    // plug_pre_reload() returned, the host swaps the library from there
+    uint32_t device_rate;  // The device outlives every build, and raylib only reports its rate when it opens
+} Handoff;
+
+typedef struct {
+    float played;        // GetMusicTimePlayed() of the current track when the callback was detached
+    float missed;        // Seconds of audio the analysis did not see during the reload
+    uint64_t resume_ns;  // plug_post_reload() started
+    uint64_t ready_ns;   // plug_post_reload() returned
+    bool pending;        // Until the first frame after the reload is presented
+} Reload;
+
+typedef enum {
+    MEM_PLUG,
+    MEM_TRACKS,
+    MEM_ASSETS,
+    MEM_POPUPS,
+    MEM_FFT,
+    MEM_UI,
+    MEM_DEBUG,
+    COUNT_MEM_TAGS
+} MemTag;
+
+// Sits in front of every block so that FREE knows what to give back to which tag
+typedef union {
+    struct {
+        size_t size;
+        MemTag tag;
+        size_t offset;  // From the start of the allocation to the header, for mem_malloc_aligned()
+    };
+    max_align_t align;
+} MemHeader;
+
+typedef struct {
+    _Atomic uint64_t live[COUNT_MEM_TAGS];  // Bytes
+    _Atomic uint64_t peak[COUNT_MEM_TAGS];  // Bytes
+    _Atomic uint64_t allocs;                // Number of MALLOC and REALLOC calls
+    uint64_t frame_allocs;                  // Allocations made during the last plug_update()
+} MemStats;
+
 /* Forward Declarations */
+// Memory Accounting
+static void mem_account(MemTag tag, size_t size, bool alloc);
+static void* mem_malloc(MemTag tag, size_t size);
+static void* mem_malloc_aligned(MemTag tag, size_t size);
+static void* mem_realloc(MemTag tag, void* ptr, size_t size);
+static void mem_free(void* ptr);
+static void mem_summary(void);
 // Assets Management
+static char* assets_key(const char* file_path);
 static Image assets_image(const char* file_path);
+static Texture2D assets_texture_from(Image image);
 static Texture2D assets_texture(const char* file_path);
+static void assets_refresh(void);
 static void assets_unload(void);
+static void circle_load(void);
 // Active UI handlers
 static int handle_btn(uint64_t id, Rectangle boundary);
 // FFT and Audio Processing
@@ -116,17 +609,75 @@ static void fft_clean(void);
 static void fft_clean_in(void);
 static void* fft_thread(void* arg);
 static void fft(float in[], size_t stride, float complex out[], size_t n);
+static void fft_complex(const float complex in[], size_t stride, float complex out[], size_t n);
+static void fft_window(const float in[], float out[]);
+static void fft_bands_init(BandMap* bm);
+static void fft_normalize(float bands[], size_t count);
+static size_t fft_reduce(const float complex in[], float bands[]);
+static size_t fft_analyze(const float in[], float windowed[], float complex out[], float bands[]);
+static void fft_smooth(float dt);
 static void fft_proccess(float dt);
+static void fft_engine_next(void);
 static void draw_texture_from_endpoints(Texture2D tex, Vector2 start_pos, Vector2 end_pos, float radius, Color c);
 static void fft_render(Rectangle boundary);
-static void fft_push(float frame);
+static void fft_push(const float frames[], size_t n);
+static uint64_t fft_center_pos(uint64_t in_pos, unsigned int rate);
 static void callback(void* bufferData, unsigned int frames);
+static void audio_stats_summary(void);
+static void audio_device_log(int level, const char* text, va_list args);
+static void audio_device_open(void);
+static void audio_rate_set(unsigned int rate);
+// Resampler
+static unsigned int gcd(unsigned int a, unsigned int b);
+static void resampler_init(Resampler* r, unsigned int in_rate);
+static size_t resampler_run(Resampler* r, size_t n);
+static size_t resampler_chunk(const Resampler* r);
+static size_t resampler_feed(Resampler* r, float (*fs)[2], size_t frames, unsigned int rate);
+// Multi-resolution Analysis
+static void mr_init(MultiRes* mr, const BandMap* bm);
+static float* mr_level_input(MultiRes* mr, size_t k);
+static void mr_decimate(const float h[], const float in[], size_t n, float out[]);
+static size_t mr_proccess(float bands[]);
+// Sliding DFT
+static size_t sdft_group(uint32_t width);
+static void sdft_tables(Sdft* s, const BandMap* bm);
+static void sdft_init(Sdft* s, const BandMap* bm);
+static void sdft_push(Sdft* s, const float frames[], size_t n);
+static size_t sdft_proccess(float bands[]);
+// Parallel FFT
+static void pfft_pool_init(FftPool* pool, size_t threads, size_t capacity);
+static void pfft_pool_free(FftPool* pool);
+static void pfft_transpose_in(const float in[], float complex out[], size_t rows, size_t cols, size_t r0, size_t r1);
+static void pfft_transpose(const float complex in[], float complex out[], size_t rows, size_t cols, size_t r0, size_t r1);
+static void pfft_step(FftPool* pool, PfftStep step);
+static void pfft_steps(FftPool* pool);
+static void* pfft_thread(void* arg);
+static void pfft(FftPool* pool, float in[], float complex out[], size_t n);
+// Audio Feeder
+static void* audio_feeder_thread(void* arg);
+static void audio_feeder_start(void);
+static void audio_feeder_stop(void);
+// Spectrum Export
+static void shm_export_open(const char* name);
+static void shm_export_close(void);
+static void shm_export_publish(void);
+// Scheduling
+static bool sched_parse_cpus(const char* list, cpu_set_t* cpus);
+static void sched_format_cpus(const cpu_set_t* cpus, char* out, size_t size);
+static const char* sched_policy_name(int policy);
+static void sched_load(void);
+static void sched_apply(SchedRole role);
 // Track and Music Management
-static Track* track_get_cur();
-static Track* track_get_by_id(int i);
+static void tracks_reserve(Tracks* ts, size_t n);
+static void tracks_free(Tracks* ts);
+static void tracks_compact_paths(Tracks* ts);
+static void tracks_push(Tracks* ts, Music music, const char* file_path, unsigned char* file_data, size_t file_size);
+static Music* track_get_cur();
+static Music* track_get_by_id(int i);
+static const char* track_get_path(int i);
 static void track_remove(int i);
 static void track_swap(int i, int j);
-static void track_next_shuffle();
+static void track_next_shuffle(bool repeat);
 static void track_next_in_order();
 static void track_prev();
 static bool track_exists(const char* file_path);
@@ -134,17 +685,29 @@ static void track_play(size_t id);
 static void track_stop_play();
 static void track_prev_handle();
 static void track_next_handle(bool by_user);
-static void track_add(char* file_path);
+static void track_add(const char* file_path);
+static void track_unload(size_t slot);
+static void track_prefetch(int i);
+static void track_seek(float secs);
 static void music_play_pause();
 static void music_volume_up();
 static void music_volume_down();
 static bool music_is_playing();
 static void music_mute(float* prev_volume);
+// Shuffle Order
+static void shuffle_swap_pos(Shuffle* s, size_t a, size_t b);
+static void shuffle_add(Shuffle* s);
+static void shuffle_remove(Shuffle* s, size_t slot, size_t last);
+static int shuffle_next(Shuffle* s);
+static int shuffle_prev(Shuffle* s);
+static void shuffle_jump(Shuffle* s, size_t i);
+static void shuffle_reshuffle(Shuffle* s);
+static void shuffle_restart(Shuffle* s);
 // Timeline UI renderer
-#define timeline_render(boundary, track) timeline_render_loc(__FILE__, __LINE__, boundary, track);
-static void timeline_render_loc(const char* file, int line, Rectangle boundary, Track* track);
+#define timeline_render(boundary, music) timeline_render_loc(__FILE__, __LINE__, boundary, music);
+static void timeline_render_loc(const char* file, int line, Rectangle boundary, Music* music);
 // Popup Management
-static void popups_push(Popups* ps, char* header, char* msg);
+static void popups_push(Popups* ps, const char* header, const char* msg);
 static void popups_render(Popups* ps, Rectangle boundary, float dt);
 // Fullscreen Button UI renderer
 #define fullscreen_btn_render(boundary) fullscreen_btn_loc(__FILE__, __LINE__, boundary)
@@ -165,11 +728,80 @@ static void handle_scroll(Rectangle boundary, bool* scroll, float* scroll_offset
 static void music_options_loc(const char* file, int line, Rectangle boundary, PlayMode icon, int icon_pos);
 #define music_control_render(boundary, icon, icon_pos) music_control_loc(__FILE__, __LINE__, boundary, icon, icon_pos)
 static void music_control_loc(const char* file, int line, Rectangle boundary, MusicControl icon, int icon_pos);
+// Profiler
+static void prof_begin(ProfStage stage);
+static void prof_end(ProfStage stage);
+static void prof_percentiles(const ProfRing* ring, float out[3]);
+static void prof_render(Rectangle boundary);
+static void prof_dump(const char* file_path);
+// Tracing
+static void trace_event(TraceThread th, const char* name, char phase, float value);
+static void trace_begin(TraceThread th, const char* name);
+static void trace_end(TraceThread th, const char* name);
+static void trace_counter(TraceThread th, const char* name, float value);
+static void trace_start(void);
+static void trace_stop(const char* file_path);
+// Record and Replay
+static void rec_start(const char* file_path);
+static void rec_stop(void);
+static void rec_capture(float (*fs)[2], unsigned int frames);
+static void rec_frame(float dt);
+// Latency Measurement
+static bool latency_click_train_export(const char* file_path);
+static void latency_toggle(void);
+static void latency_update(Music* music);
+static void latency_render(Rectangle boundary);
+// Spectrum Cache
+static bool cache_path(char* out, size_t size, uint64_t key, const char* ext);
+static uint64_t cache_key(const char* file_path, const void* config, size_t config_size);
+static uint64_t spec_key(const char* file_path);
+static bool spec_map(const char* cache, uint64_t key);
+static void spec_unmap(void);
+static void spec_open(const char* file_path);
+static bool spec_lookup(float dt);
+static float wave_sample(const Wave* wave, size_t i);
+static void* spec_job_thread(void* arg);
+static void spec_job_start(const char* file_path, const char* cache, uint64_t key);
+static void spec_job_poll(void);
+static void spec_job_stop(void);
+// Waveform Overview
+static uint64_t peaks_key(const char* file_path);
+static size_t peaks_layout(uint64_t frame_count, uint32_t base, size_t counts[PEAKS_MAX_LEVELS], uint32_t* level_count);
+static bool peaks_map(const char* cache, uint64_t key);
+static void peaks_unmap(void);
+static void peaks_open(const char* file_path);
+static void peaks_render(Rectangle boundary, float progress);
+static void* peaks_job_thread(void* arg);
+static void peaks_job_start(const char* file_path, const char* cache, uint64_t key);
+static void peaks_job_poll(void);
+static void peaks_job_stop(void);
+// Offline Analysis
+static void analyze_log(int level, const char* text, va_list args);
+static bool analyze_file(const char* in_path, const char* out_path, size_t hop, bool csv);
+static void analyze_worker(AnalyzeQueue* q, char** files, size_t count, const char* out_dir, size_t hop, bool csv);
+static int analyze_name_cmp(const void* a, const void* b);
+static bool analyze_names_unique(char** files, size_t count, const char* out_dir, bool csv);
+// Offline Rendering
+static void render_quad_from_endpoints(RenderQuads* qs, float x, float start_y, float end_y, float radius, Color c);
+static float render_quads_build(RenderQuads* qs, float w, float h);
+static void render_tile(Renderer* r, size_t tile);
+static void render_tiles(Renderer* r);
+static void* render_thread(void* arg);
+static void render_frame(Renderer* r);
+// Hot Reload
+static void reload_save(void);
+static void reload_resume(void);
+static void reload_adopt(Handoff* prev);
+static void reload_report(void);
 // Helpers
 static void str_fit_width(char* text, float width, float font_size, float text_pad);
 static char* get_track_name(const char* file_path);
+static long env_long(const char* name, long fallback);
+static bool input_pressed(void);
 static Rectangle calculate_preview(void);
 static void draw_icon(const char* file_path, int icon_id, int icon_cnt, Rectangle dest, Color c);
+// Plugin API
+void plug_init(void);
 
 /* Constants */
 // Fragment Files
@@ -192,14 +824,36 @@ static void draw_icon(const char* file_path, int icon_id, int icon_cnt, Rectangl
 #define KEY_TRACK_PREV KEY_LEFT
 #define KEY_VOLUME_UP KEY_UP
 #define KEY_VOLUME_DOWN KEY_DOWN
+#define KEY_PROFILER KEY_F3
+#define KEY_PROFILER_DUMP KEY_F4
+#define KEY_LATENCY KEY_F6
+#define KEY_TRACE KEY_F7
+#define KEY_RECORD KEY_F8
+#define KEY_ENGINE KEY_F9
 
 // Parameters
 #define FFT_SIZE (1 << 15)
+#define ANALYSIS_RATE 44100  // in_raw is always at this rate, so the bands mean the same Hz for every track
 #define FREQ_STEP 1.01f
 #define LOW_FREQ 22.0f
 #define SMOOTHNESS 30
 #define SMEARNESS 5
 
+#define PFFT_MIN_SIZE (1 << 14)  // Below this the barriers cost more than the threads save
+#define PFFT_MAX_THREADS 64
+#define PFFT_TILE 32  // Transposes go a PFFT_TILE square at a time
+#define PFFT_THREADS_ENV "MUSICVIS_FFT_THREADS"
+
+#define AUDIO_STREAM_BUFFER_FRAMES 4096
+#define AUDIO_FEEDER_SLEEP_SECS 0.002
+#define AUDIO_FEEDER_PRIORITY 10
+#define AUDIO_DEVICE_FALLBACK_RATE 48000  // The usual native rate, only if raylib stops reporting it
+#define FFT_IDLE_SLEEP_SECS 0.001  // Polling for new samples, well below the period of the audio callback
+#define SHM_ENV "MUSICVIS_SHM"
+#define SCHED_ENV_PREFIX "MUSICVIS_"
+#define SCHED_BACKGROUND_NICE 10
+#define SEEK_COALESCE_SECS 0.03
+
 #define BASE_WIDTH 1920.0f
 #define BASE_HEIGHT 1080.0f
 
@@ -209,6 +863,7 @@ static void draw_icon(const char* file_path, int icon_id, int icon_cnt, Rectangl
 
 #define PANEL_PERCENT 0.25f
 #define TIMELINE_PERCENT 0.1f
+#define TIMELINE_WAVE_PERCENT 0.8f
 #define SCROLL_PERCENT 0.02f
 #define TRACK_ITEM_PERCENT 0.2f
 #define VELOCITY_DECAY 0.9f
@@ -226,6 +881,38 @@ static void draw_icon(const char* file_path, int icon_id, int icon_cnt, Rectangl
 #define HUD_POPUP_HEIGHT 50.0f
 #define HUD_POPUP_PAD 10.0f
 
+#define FRAME_ARENA_CAPACITY (64 * 1024)
+
+#define PROF_FONT_SIZE 15.0f
+#define PROF_PAD 10.0f
+#define PROF_CSV_FILEPATH "./profile.csv"
+#define TRACE_JSON_FILEPATH "./trace.json"
+#define REC_FILEPATH "./session.mvr"
+#define REC_MAX_EVENTS 1024  // Per frame
+
+#define LATENCY_CLICK_FILEPATH "/tmp/musicvis-click-train.wav"
+#define LATENCY_CLICK_RATE 44100
+#define LATENCY_CLICK_TRAIN_SECS 60
+#define LATENCY_CLICK_PERIOD_SECS 2  // Longer than the FFT window, so every click starts from silence
+#define LATENCY_CLICK_SECS 0.002f
+#define LATENCY_CLICK_THRESHOLD 0.25f
+
+#define CACHE_DIR_NAME "musicvis"  // Under $XDG_CACHE_HOME, or ~/.cache without it
+#define SPEC_CACHE_EXT "mvc"
+#define SPEC_HOP 1024
+
+#define PEAKS_CACHE_EXT "mvw"
+#define PEAKS_BASE 256  // Frames per bucket of the finest level
+
+#define ANALYZE_HOP 1024
+
+#define RENDER_WIDTH 1920
+#define RENDER_HEIGHT 1080
+#define RENDER_FPS 60
+#define RENDER_TILE_SIZE 64
+#define RENDER_QUADS_PER_BAND 6
+#define RENDER_REACH_CELLS 3  // Circles are the widest quads, 3 * cell_width * sqrtf(t_smooth) to either side
+
 #define HSV_SATURATION 0.75f
 #define HSV_VALUE 1.0f
 
@@ -240,23 +927,140 @@ static void draw_icon(const char* file_path, int icon_id, int icon_cnt, Rectangl
 #define COLOR_TRACK_BUTTON_SELECTED COLOR_ACCENT
 #define COLOR_TIMELINE_CURSOR COLOR_ACCENT
 #define COLOR_TIMELINE_BACKGROUND ColorBrightness(COLOR_BACKGROUND, -0.3)
+#define COLOR_TIMELINE_WAVE ColorBrightness(COLOR_BACKGROUND, 0.25)
+#define COLOR_TIMELINE_WAVE_PLAYED ColorAlpha(COLOR_ACCENT, 0.6)
 #define COLOR_HUD_BTN_BACKGROUND ColorBrightness(COLOR_BACKGROUND, 0.15)
 #define COLOR_HUD_BTN_HOVEROVER ColorBrightness(COLOR_HUD_BTN_BACKGROUND, 0.15)
 #define COLOR_POPUP_BACKGROUND ColorBrightness(COLOR_BACKGROUND, 0.2)
+#define COLOR_PROF_BACKGROUND ColorAlpha(ColorBrightness(COLOR_BACKGROUND, -0.5), 0.8)
 
 static_assert(COUNT_UNIFORMS == 2, "Update list of uniform names");
 const char* uniform_names[COUNT_UNIFORMS] = {
     [CIRCLE_RADIUS_UNIFORM] = "radius",
     [CIRCLE_POWER_UNIFORM] = "power"};
 
+static_assert(COUNT_PROF_STAGES == 12, "Update list of profiler stage names");
+const char* prof_stage_names[COUNT_PROF_STAGES] = {
+    [PROF_FRAME] = "frame",
+    [PROF_INPUT] = "input",
+    [PROF_FFT_RENDER] = "fft_render",
+    [PROF_POPUPS_RENDER] = "popups_render",
+    [PROF_TRACKS_PANEL_RENDER] = "tracks_panel_render",
+    [PROF_TIMELINE_RENDER] = "timeline_render",
+    [PROF_END_DRAWING] = "end_drawing",
+    [PROF_UPDATE_MUSIC] = "update_music",
+    [PROF_FFT_WINDOW] = "fft_window",
+    [PROF_FFT_TRANSFORM] = "fft_transform",
+    [PROF_FFT_REDUCE] = "fft_reduce",
+    [PROF_FFT_PUBLISH] = "fft_publish",
+};
+
+static_assert(COUNT_PROF_STAGES == 12, "Update list of profiler stage threads");
+const TraceThread prof_stage_threads[COUNT_PROF_STAGES] = {
+    [PROF_FRAME] = TRACE_RENDER,
+    [PROF_INPUT] = TRACE_RENDER,
+    [PROF_FFT_RENDER] = TRACE_RENDER,
+    [PROF_POPUPS_RENDER] = TRACE_RENDER,
+    [PROF_TRACKS_PANEL_RENDER] = TRACE_RENDER,
+    [PROF_TIMELINE_RENDER] = TRACE_RENDER,
+    [PROF_END_DRAWING] = TRACE_RENDER,
+    [PROF_UPDATE_MUSIC] = TRACE_FEEDER,
+    [PROF_FFT_WINDOW] = TRACE_ANALYSIS,
+    [PROF_FFT_TRANSFORM] = TRACE_ANALYSIS,
+    [PROF_FFT_REDUCE] = TRACE_ANALYSIS,
+    [PROF_FFT_PUBLISH] = TRACE_ANALYSIS,
+};
+
+static_assert(COUNT_ENGINES == 3, "Update list of analysis engine names");
+const char* engine_names[COUNT_ENGINES] = {
+    [ENGINE_FFT] = "FFT",
+    [ENGINE_MULTIRES] = "Multi-resolution",
+    [ENGINE_SDFT] = "Sliding DFT",
+};
+
+static_assert((MR_SIZE << (MR_LEVELS - 1)) == FFT_SIZE, "The longest multi-resolution window has to match FFT_SIZE");
+
+static_assert(COUNT_SCHED_ROLES == 3, "Update list of scheduling role names");
+const char* sched_role_names[COUNT_SCHED_ROLES] = {
+    [SCHED_ROLE_ANALYSIS] = "analysis",
+    [SCHED_ROLE_FEEDER] = "feeder",
+    [SCHED_ROLE_BACKGROUND] = "background",
+};
+
+static_assert(COUNT_MEM_TAGS == 7, "Update list of memory tag names");
+const char* mem_tag_names[COUNT_MEM_TAGS] = {
+    [MEM_PLUG] = "plug",
+    [MEM_TRACKS] = "tracks",
+    [MEM_ASSETS] = "assets",
+    [MEM_POPUPS] = "popups",
+    [MEM_FFT] = "fft",
+    [MEM_UI] = "ui",
+    [MEM_DEBUG] = "debug",
+};
+
+static_assert(COUNT_TRACE_THREADS == 4, "Update list of trace thread names");
+const char* trace_thread_names[COUNT_TRACE_THREADS] = {
+    [TRACE_RENDER] = "render",
+    [TRACE_ANALYSIS] = "analysis",
+    [TRACE_AUDIO] = "audio",
+    [TRACE_FEEDER] = "feeder",
+};
+
 static_assert(COUNT_FRAGMENTS == 1, "Update list of fragment file paths");
 const char* fragment_files[COUNT_FRAGMENTS] = {
     [CIRCLE_FRAGMENT] = CIRCLE_FS_FILEPATH,
 };
 
+// Written by callback() on the audio device thread, the analysis thread reads in_raw and the resonators
+typedef struct {
+    _Alignas(CACHE_LINE) float in_raw[FFT_SIZE];
+    Resampler resampler;
+    Sdft sdft;
+    _Atomic size_t in_hold;   // Samples to push before the window is whole again, reset by fft_clean_in()
+    _Atomic uint64_t in_pos;  // Device frames up to the newest sample in in_raw, counted like callback() gets them
+    AudioStats stats;
+
+    // Read on every buffer and written only when the device opens or the engine changes, away from the counters above.
+    // The rate is the device's, raylib converts every stream to it before callback()
+    _Alignas(CACHE_LINE) _Atomic unsigned int rate;
+    _Atomic Engine engine;
+} AudioBlock;
+
+// Owned by the analysis thread. The published spectrum is the only part the render thread touches, under th_mutex
+typedef struct {
+    _Alignas(CACHE_LINE) float in_windowed[FFT_SIZE];
+    float complex out_raw[FFT_SIZE];
+    float out_logscaled[FFT_SIZE];
+    float hann[FFT_SIZE];
+    BandMap bands;
+    MultiRes mr;
+    FftPool pfft;
+    uint64_t shm_pos;  // out_pos of the last exported spectrum
+
+    // Published
+    _Alignas(CACHE_LINE) pthread_mutex_t th_mutex;
+    size_t freq_count;
+    uint64_t out_pos;  // Device frame the published spectrum represents, counted like in_pos
+    float out_smoothed[FFT_SIZE];
+    float out_smeared[FFT_SIZE];
+} AnalysisBlock;
+
+// Owned by the render thread, its copy of the published spectrum
+typedef struct {
+    _Alignas(CACHE_LINE) size_t count;
+    uint64_t pos;
+    float smoothed[BAND_CAPACITY];
+    float smeared[BAND_CAPACITY];
+} RenderBlock;
+
 typedef struct {
+    Handoff handoff;
+    Reload reload;
+
     // Player
     Tracks tracks;
+    Peaks peaks;
+    Shuffle shuffle;
     int cur_track;
     bool music_is_paused;
     float volume;
@@ -264,46 +1068,156 @@ typedef struct {
 
     // UI
     Shader circle;
+    long circle_mtime;
     int uniform_locs[COUNT_UNIFORMS];
     bool fullscreen;
     uint64_t active_btn_id;
 
+    // Memory
+    MemStats mem;
+    Arena frame;  // Reset at the start of every plug_update(), for text and scratch that only live for one frame
+
     // Assets
     Assets assets;
     Popups popups;
 
-    // FFT
-    size_t freq_count;
-    float in_raw[FFT_SIZE];
-    float in_windowed[FFT_SIZE];
-    float complex out_raw[FFT_SIZE];
-    float out_logscaled[FFT_SIZE];
-    float out_smoothed[FFT_SIZE];
-    float out_smeared[FFT_SIZE];
-    float hann[FFT_SIZE];
+    // Profiler
+    Profiler prof;
+    Latency latency;
+    Tracer trace;
+    Recorder rec;
+
+    // Per-thread blocks, each one allocated on its own cache lines
+    AudioBlock* audio;
+    AnalysisBlock* analysis;
+    RenderBlock* render;
+    SpecCache spec;
 
     // Multi Threading
-    bool th_stop;
-    pthread_mutex_t th_mutex;
+    _Atomic bool th_stop;
     pthread_t th;
-    float* out_smoothed_buf;
-    float* out_smeared_buf;
+
+    // Audio Feeder
+    _Atomic bool feeder_stop;
+    pthread_mutex_t audio_mutex;
+    pthread_t feeder;
+    float seek_pending;
+
+    // Scheduling
+    SchedConfig sched[COUNT_SCHED_ROLES];
+
+    // Spectrum Export
+    ShmSpectrum* shm;
+    char shm_name[NAME_MAX];
 } Plug;
 
+static_assert(offsetof(Plug, handoff) == 0, "Every build has to find the Handoff at the start of the state");
+
 static Plug* p = NULL;
 
+/* Memory Accounting */
+static void mem_account(MemTag tag, size_t size, bool alloc) {
+    if (p == NULL) return;  // The Plug itself is accounted for right after it is allocated
+
+    MemStats* mem = &p->mem;
+    if (alloc) {
+        uint64_t live = atomic_fetch_add_explicit(&mem->live[tag], size, memory_order_relaxed) + size;
+        atomic_max_u64(&mem->peak[tag], live);
+        atomic_fetch_add_explicit(&mem->allocs, 1, memory_order_relaxed);
+    } else {
+        atomic_fetch_sub_explicit(&mem->live[tag], size, memory_order_relaxed);
+    }
+}
+
+static void* mem_malloc(MemTag tag, size_t size) {
+    MemHeader* header = malloc(sizeof(*header) + size);
+    if (header == NULL) return NULL;
+
+    header->size = size;
+    header->tag = tag;
+    header->offset = 0;
+    mem_account(tag, size, true);
+    return header + 1;
+}
+
+// Starts on a cache line and ends on one, for the blocks that different threads write. FREE takes it back like any
+// other block, it can not be resized
+static void* mem_malloc_aligned(MemTag tag, size_t size) {
+    static_assert(sizeof(MemHeader) <= CACHE_LINE, "The header has to fit in front of the block");
+    size_t padded = (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    char* base = aligned_alloc(CACHE_LINE, CACHE_LINE + padded);
+    if (base == NULL) return NULL;
+
+    MemHeader* header = (MemHeader*)(base + CACHE_LINE) - 1;
+    header->size = size;
+    header->tag = tag;
+    header->offset = CACHE_LINE - sizeof(*header);
+    mem_account(tag, size, true);
+    return header + 1;
+}
+
+static void* mem_realloc(MemTag tag, void* ptr, size_t size) {
+    if (ptr == NULL) return mem_malloc(tag, size);
+
+    // The block keeps the tag it was first allocated with
+    MemHeader* header = (MemHeader*)ptr - 1;
+    assert(header->offset == 0 && "ERROR: Aligned blocks can not be resized");
+    size_t prev_size = header->size;
+    header = realloc(header, sizeof(*header) + size);
+    if (header == NULL) return NULL;
+
+    mem_account(header->tag, prev_size, false);
+    header->size = size;
+    mem_account(header->tag, size, true);
+    return header + 1;
+}
+
+static void mem_free(void* ptr) {
+    if (ptr == NULL) return;
+
+    MemHeader* header = (MemHeader*)ptr - 1;
+    mem_account(header->tag, header->size, false);
+    free((char*)header - header->offset);
+}
+
+static void mem_summary(void) {
+    for (MemTag tag = 0; tag < COUNT_MEM_TAGS; ++tag) {
+        printf("INFO: Memory %-6s live %10lu B, peak %10lu B\n", mem_tag_names[tag],
+               (unsigned long)atomic_load(&p->mem.live[tag]), (unsigned long)atomic_load(&p->mem.peak[tag]));
+    }
+    printf("INFO: Memory allocations: %lu\n", (unsigned long)atomic_load(&p->mem.allocs));
+}
+
 /* Assets Management */
+#undef MEM_TAG
+#define MEM_TAG MEM_ASSETS
+static char* assets_key(const char* file_path) {
+    size_t size = strlen(file_path) + 1;
+    char* key = MALLOC(size);
+    assert(key != NULL && "ERROR: Not enough RAM");
+    memcpy(key, file_path, size);
+    return key;
+}
+
 static Image assets_image(const char* file_path) {
     Image* image = assoc_find(p->assets.images, file_path);
     if (image) return *image;
 
     ImageItem item = {0};
-    item.key = file_path;
+    item.key = assets_key(file_path);
     item.value = LoadImage(file_path);
+    item.mtime = GetFileModTime(file_path);
     da_append(&p->assets.images, item);
     return item.value;
 }
 
+static Texture2D assets_texture_from(Image image) {
+    Texture2D texture = LoadTextureFromImage(image);
+    GenTextureMipmaps(&texture);
+    SetTextureFilter(texture, TEXTURE_FILTER_BILINEAR);
+    return texture;
+}
+
 static Texture2D assets_texture(const char* file_path) {
     Texture2D* texture = assoc_find(p->assets.textures, file_path);
     if (texture) return *texture;
@@ -311,26 +1225,71 @@ static Texture2D assets_texture(const char* file_path) {
     Image image = assets_image(file_path);
 
     TextureItem item = {0};
-    item.key = file_path;
-    item.value = LoadTextureFromImage(image);
-    GenTextureMipmaps(&item.value);
-    SetTextureFilter(item.value, TEXTURE_FILTER_BILINEAR);
+    item.key = assets_key(file_path);
+    item.value = assets_texture_from(image);
+    item.mtime = GetFileModTime(file_path);
     da_append(&p->assets.textures, item);
     return item.value;
 }
 
+// Reloads the assets whose files changed since they were loaded, the rest stays on the GPU as it is
+static void assets_refresh(void) {
+    size_t count = 0;
+    for (size_t i = 0; i < p->assets.images.count; i++) {
+        ImageItem* item = &p->assets.images.items[i];
+        long mtime = GetFileModTime(item->key);
+        if (mtime == item->mtime) continue;
+
+        UnloadImage(item->value);
+        item->value = LoadImage(item->key);
+        item->mtime = mtime;
+        count += 1;
+    }
+    // After the images, a texture is rebuilt from its already reloaded image
+    for (size_t i = 0; i < p->assets.textures.count; i++) {
+        TextureItem* item = &p->assets.textures.items[i];
+        long mtime = GetFileModTime(item->key);
+        if (mtime == item->mtime) continue;
+
+        UnloadTexture(item->value);
+        item->value = assets_texture_from(assets_image(item->key));
+        item->mtime = mtime;
+        count += 1;
+    }
+
+    long mtime = GetFileModTime(fragment_files[CIRCLE_FRAGMENT]);
+    if (mtime != p->circle_mtime) {
+        UnloadShader(p->circle);
+        circle_load();
+        count += 1;
+    }
+    if (count > 0) printf("INFO: Reloaded %zu changed assets\n", count);
+}
+
 static void assets_unload() {
     for (size_t i = 0; i < p->assets.textures.count; i++) {
         UnloadTexture(p->assets.textures.items[i].value);
+        FREE(p->assets.textures.items[i].key);
     }
     p->assets.textures.count = 0;
     for (size_t i = 0; i < p->assets.images.count; i++) {
         UnloadImage(p->assets.images.items[i].value);
+        FREE(p->assets.images.items[i].key);
     }
     p->assets.images.count = 0;
 }
 
+static void circle_load(void) {
+    p->circle = LoadShader(NULL, fragment_files[CIRCLE_FRAGMENT]);
+    p->circle_mtime = GetFileModTime(fragment_files[CIRCLE_FRAGMENT]);
+    for (Uniform i = 0; i < COUNT_UNIFORMS; i++) {
+        p->uniform_locs[i] = GetShaderLocation(p->circle, uniform_names[i]);
+    }
+}
+
 /* Active UI handlers */
+#undef MEM_TAG
+#define MEM_TAG MEM_UI
 static int handle_btn(uint64_t id, Rectangle boundary) {
     Vector2 mouse = GetMousePosition();
     static Vector2 prev_mouse = {0};
@@ -372,18 +1331,22 @@ static int handle_btn(uint64_t id, Rectangle boundary) {
 }
 
 /* FFT and Audio Processing */
+#undef MEM_TAG
+#define MEM_TAG MEM_FFT
 static void fft_clean(void) {
-    memset(p->in_raw, 0, sizeof(p->in_raw));
-    memset(p->in_windowed, 0, sizeof(p->in_windowed));
-    memset(p->out_raw, 0, sizeof(p->out_raw));
-    memset(p->out_logscaled, 0, sizeof(p->out_logscaled));
-    memset(p->out_smoothed, 0, sizeof(p->out_smoothed));
-    memset(p->out_smeared, 0, sizeof(p->out_smeared));
+    memset(p->audio->in_raw, 0, sizeof(p->audio->in_raw));
+    memset(p->analysis->in_windowed, 0, sizeof(p->analysis->in_windowed));
+    memset(p->analysis->out_raw, 0, sizeof(p->analysis->out_raw));
+    memset(p->analysis->out_logscaled, 0, sizeof(p->analysis->out_logscaled));
+    memset(p->analysis->out_smoothed, 0, sizeof(p->analysis->out_smoothed));
+    memset(p->analysis->out_smeared, 0, sizeof(p->analysis->out_smeared));
 }
 
 static void fft_clean_in(void) {
-    memset(p->in_raw, 0, sizeof(p->in_raw));
-    memset(p->in_windowed, 0, sizeof(p->in_windowed));
+    memset(p->audio->in_raw, 0, sizeof(p->audio->in_raw));
+    memset(p->analysis->in_windowed, 0, sizeof(p->analysis->in_windowed));
+    atomic_store(&p->audio->sdft.reset, true);
+    atomic_store(&p->audio->in_hold, FFT_SIZE / 2);  // Keep the last spectrum on screen until the window refills
 }
 
 static void fft(float in[], size_t stride, float complex out[], size_t n) {
@@ -404,51 +1367,190 @@ static void fft(float in[], size_t stride, float complex out[], size_t n) {
     }
 }
 
+// fft() for complex input
+static void fft_complex(const float complex in[], size_t stride, float complex out[], size_t n) {
+    if (n == 1) {
+        out[0] = in[0];
+        return;
+    }
+
+    fft_complex(in, stride * 2, out, n / 2);
+    fft_complex(in + stride, stride * 2, out + n / 2, n / 2);
+
+    for (size_t k = 0; k < n / 2; ++k) {
+        float t = (float)k / n;
+        float complex v = cexp(-2 * I * PI * t) * out[k + n / 2];
+        float complex e = out[k];
+        out[k] = e + v;
+        out[k + n / 2] = e - v;
+    }
+}
+
 static void* fft_thread(void* arg) {
     (void)arg;
+    sched_apply(SCHED_ROLE_ANALYSIS);
     printf("INFO: FFT Thread started\n");
 
-    while (!p->th_stop) {
-        fft_proccess(GetFrameTime());
+    uint64_t prev_in_pos = UINT64_MAX;
+    Engine prev_engine = COUNT_ENGINES;
+    double prev_step = time_now();
+    while (!atomic_load(&p->th_stop)) {
+        // Until the audio thread pushes more samples there is nothing new to publish, looking the cache up again
+        // would only burn the core and hold th_mutex against fft_render()
+        uint64_t in_pos = atomic_load(&p->audio->in_pos);
+        Engine engine = atomic_load(&p->audio->engine);
+        if (in_pos == prev_in_pos && engine == prev_engine) {
+            time_sleep(FFT_IDLE_SLEEP_SECS);
+            continue;
+        }
+
+        // The resonators are current after every callback however few samples it brings, so the sliding DFT
+        // is read on a deadline instead, a read costs the same O(bands) for one sample as for a whole hop
+        double now = time_now();
+        double deadline = prev_step + 1.0 / SDFT_REFRESH_HZ;
+        if (engine == ENGINE_SDFT && engine == prev_engine && now < deadline) {
+            time_sleep(deadline - now);
+            continue;
+        }
+        prev_in_pos = in_pos;
+        prev_engine = engine;
+
+        // The smoothing eases by the time that really passed since the previous spectrum, not the render frame
+        fft_proccess(now - prev_step);
+        prev_step = now;
     }
 
     printf("INFO: FFT Thread stopped\n");
     pthread_exit(NULL);
 }
 
-static void fft_proccess(float dt) {
-    size_t freq_count = 0;
-    float max_amp = 1.0f;
-
-    // Hann Windowing
+static void fft_window(const float in[], float out[]) {
     for (size_t i = 0; i < FFT_SIZE; ++i) {
-        p->in_windowed[i] = p->in_raw[i] * p->hann[i];
+        out[i] = in[i] * p->analysis->hann[i];
     }
+}
 
-    // Perform FFT
-    fft(p->in_windowed, 1, p->out_raw, FFT_SIZE);
-
+static void fft_bands_init(BandMap* bm) {
+    bm->count = 0;
     for (float f = LOW_FREQ; (size_t)f < FFT_SIZE / 2; f = ceilf(f * FREQ_STEP)) {
+        assert(bm->count < BAND_CAPACITY && "ERROR: Increase BAND_CAPACITY");
         float f1 = ceilf(f * FREQ_STEP);
-        float ampl = 0.0f;
+        bm->lo[bm->count] = (uint32_t)f;
+        bm->hi[bm->count] = (size_t)f1 < FFT_SIZE / 2 ? (uint32_t)f1 : FFT_SIZE / 2;
+        bm->count += 1;
+    }
+}
+
+static void fft_normalize(float bands[], size_t count) {
+    float max_amp = 1.0f;
+    for (size_t i = 0; i < count; ++i) {
+        max_amp = fmaxf(max_amp, bands[i]);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        bands[i] /= max_amp;
+    }
+}
 
-        for (size_t q = (size_t)f; q < FFT_SIZE / 2 && q < (size_t)f1; ++q) {
-            float a = amp(p->out_raw[q]);
-            ampl = fmaxf(ampl, a);
+// Reduces the spectrum into log-spaced bands normalized to the loudest one, returns the band count
+static size_t fft_reduce(const float complex in[], float bands[]) {
+    const BandMap* bm = &p->analysis->bands;
+    for (size_t b = 0; b < bm->count; ++b) {
+        float ampl = 0.0f;
+        for (size_t q = bm->lo[b]; q < bm->hi[b]; ++q) {
+            ampl = fmaxf(ampl, amp(in[q]));
         }
+        bands[b] = ampl;
+    }
+    fft_normalize(bands, bm->count);
+
+    return bm->count;
+}
+
+// The whole pipeline of fft_proccess() over caller-owned buffers, for the analysis that runs off the live thread
+static size_t fft_analyze(const float in[], float windowed[], float complex out[], float bands[]) {
+    fft_window(in, windowed);
+    fft(windowed, 1, out, FFT_SIZE);
+    return fft_reduce(out, bands);
+}
+
+// Eases the published bands towards out_logscaled, dt is the time since the previous spectrum
+static void fft_smooth(float dt) {
+    // A step past the target would overshoot further every frame, which happens below 30 FPS
+    float smooth = fminf(SMOOTHNESS * dt, 1.0f);
+    float smear = fminf(SMEARNESS * dt, 1.0f);
+    AnalysisBlock* a = p->analysis;
+    for (size_t i = 0; i < a->freq_count; ++i) {
+        a->out_smoothed[i] += (a->out_logscaled[i] - a->out_smoothed[i]) * smooth;  // Smooth
+        a->out_smeared[i] += (a->out_smoothed[i] - a->out_smeared[i]) * smear;      // Smear
+    }
+}
 
-        max_amp = fmaxf(max_amp, ampl);
-        p->out_logscaled[freq_count++] = ampl;
+static void fft_proccess(float dt) {
+    // Cached tracks are looked up by position, nothing to transform and no window to refill after a seek.
+    // The cache holds what the FFT engine computes, the others always run live
+    Engine engine = atomic_load(&p->audio->engine);
+    if (engine == ENGINE_FFT && spec_lookup(dt)) {
+        shm_export_publish();
+        return;
     }
+    if (atomic_load(&p->audio->in_hold) > 0) return;
 
-    pthread_mutex_lock(&p->th_mutex);
-    for (size_t i = 0; i < p->freq_count; ++i) {
-        p->out_logscaled[i] /= max_amp;                                                      // Normalize
-        p->out_smoothed[i] += (p->out_logscaled[i] - p->out_smoothed[i]) * SMOOTHNESS * dt;  // Smooth
-        p->out_smeared[i] += (p->out_smoothed[i] - p->out_smeared[i]) * SMEARNESS * dt;      // Smear
+    uint64_t in_pos = atomic_load(&p->audio->in_pos);
+    uint64_t out_pos = fft_center_pos(in_pos, atomic_load(&p->audio->rate));
+
+    // New samples since the previous spectrum, 0 means the analysis is spinning on the same window
+    static uint64_t prev_in_pos = 0;
+    trace_counter(TRACE_ANALYSIS, "hop", in_pos >= prev_in_pos ? in_pos - prev_in_pos : 0);
+    prev_in_pos = in_pos;
+
+    size_t freq_count = 0;
+    switch (engine) {
+    case ENGINE_FFT: {
+        // Hann Windowing
+        prof_begin(PROF_FFT_WINDOW);
+        fft_window(p->audio->in_raw, p->analysis->in_windowed);
+        prof_end(PROF_FFT_WINDOW);
+
+        // Perform FFT
+        prof_begin(PROF_FFT_TRANSFORM);
+        pfft(&p->analysis->pfft, p->analysis->in_windowed, p->analysis->out_raw, FFT_SIZE);
+        prof_end(PROF_FFT_TRANSFORM);
+
+        prof_begin(PROF_FFT_REDUCE);
+        freq_count = fft_reduce(p->analysis->out_raw, p->analysis->out_logscaled);
+        prof_end(PROF_FFT_REDUCE);
+    } break;
+
+    case ENGINE_MULTIRES:
+        freq_count = mr_proccess(p->analysis->out_logscaled);
+        break;
+
+    case ENGINE_SDFT:
+        freq_count = sdft_proccess(p->analysis->out_logscaled);
+        break;
+
+    default:
+        return;
     }
-    p->freq_count = freq_count;
-    pthread_mutex_unlock(&p->th_mutex);
+
+    prof_begin(PROF_FFT_PUBLISH);
+    trace_begin(TRACE_ANALYSIS, "th_mutex");
+    pthread_mutex_lock(&p->analysis->th_mutex);
+    trace_end(TRACE_ANALYSIS, "th_mutex");
+    fft_smooth(dt);
+    p->analysis->freq_count = freq_count;
+    p->analysis->out_pos = out_pos;
+    pthread_mutex_unlock(&p->analysis->th_mutex);
+    shm_export_publish();
+    prof_end(PROF_FFT_PUBLISH);
+}
+
+static void fft_engine_next(void) {
+    Engine engine = (atomic_load(&p->audio->engine) + 1) % COUNT_ENGINES;
+    // The resonators missed everything while another engine ran
+    if (engine == ENGINE_SDFT) atomic_store(&p->audio->sdft.reset, true);
+    atomic_store(&p->audio->engine, engine);
+    popups_push(&p->popups, "Analysis engine", engine_names[engine]);
 }
 
 static void draw_texture_from_endpoints(Texture2D tex, Vector2 start_pos, Vector2 end_pos, float radius, Color c) {
@@ -475,18 +1577,23 @@ static void fft_render(Rectangle boundary) {
     float h = boundary.height;
     float w = boundary.width;
 
-    static float cell_width = 0.0f;
-
-    if (pthread_mutex_trylock(&p->th_mutex) == 0) {
-        cell_width = w / p->freq_count;
-        p->out_smoothed_buf = memcpy(p->out_smoothed_buf, p->out_smoothed, p->freq_count * sizeof(p->out_smoothed[0]));
-        p->out_smeared_buf = memcpy(p->out_smeared_buf, p->out_smeared, p->freq_count * sizeof(p->out_smeared[0]));
-        pthread_mutex_unlock(&p->th_mutex);
+    RenderBlock* r = p->render;
+    if (pthread_mutex_trylock(&p->analysis->th_mutex) == 0) {
+        r->count = p->analysis->freq_count;
+        memcpy(r->smoothed, p->analysis->out_smoothed, r->count * sizeof(r->smoothed[0]));
+        memcpy(r->smeared, p->analysis->out_smeared, r->count * sizeof(r->smeared[0]));
+        r->pos = p->analysis->out_pos;
+        pthread_mutex_unlock(&p->analysis->th_mutex);
+        trace_counter(TRACE_RENDER, "th_mutex_miss", 0);
+    } else {
+        trace_counter(TRACE_RENDER, "th_mutex_miss", 1);
     }
+    float cell_width = r->count > 0 ? w / r->count : 0.0f;
+
     // Draw Bars and Circles
-    for (size_t i = 0; i < p->freq_count; ++i) {
-        float t_smooth = p->out_smoothed_buf[i];
-        float t_smear = p->out_smeared_buf[i];
+    for (size_t i = 0; i < r->count; ++i) {
+        float t_smooth = r->smoothed[i];
+        float t_smear = r->smeared[i];
 
         float hue = 170;  //(float)i / m * 360;
         Color c = ColorFromHSV(hue, HSV_SATURATION, HSV_VALUE);
@@ -531,101 +1638,972 @@ static void fft_render(Rectangle boundary) {
     }
 }
 
-static void fft_push(float frame) {
-    memmove(p->in_raw, p->in_raw + 1, (FFT_SIZE - 1) * sizeof(p->in_raw[0]));
-    p->in_raw[FFT_SIZE - 1] = frame;
+// Shifts a whole block into in_raw at once, the newest sample ends up last
+static void fft_push(const float frames[], size_t n) {
+    AudioBlock* a = p->audio;
+    // The resonators read the samples leaving their windows, so they run before the shift
+    if (atomic_load_explicit(&a->engine, memory_order_relaxed) == ENGINE_SDFT) sdft_push(&a->sdft, frames, n);
+
+    if (n >= FFT_SIZE) {
+        memcpy(a->in_raw, frames + n - FFT_SIZE, sizeof(a->in_raw));
+        return;
+    }
+    memmove(a->in_raw, a->in_raw + n, (FFT_SIZE - n) * sizeof(a->in_raw[0]));
+    memcpy(a->in_raw + FFT_SIZE - n, frames, n * sizeof(a->in_raw[0]));
+}
+
+// The Hann window weights the middle of in_raw the most, half a window of ANALYSIS_RATE samples before in_pos
+static uint64_t fft_center_pos(uint64_t in_pos, unsigned int rate) {
+    uint64_t half = (uint64_t)FFT_SIZE / 2 * (rate > 0 ? rate : ANALYSIS_RATE) / ANALYSIS_RATE;
+    return in_pos > half ? in_pos - half : 0;
 }
 
 static void callback(void* bufferData, unsigned int frames) {
+    uint64_t start = time_now_ns();
     float(*fs)[2] = bufferData;
+    trace_begin(TRACE_AUDIO, "callback");
+
+    if (atomic_load_explicit(&p->rec.active, memory_order_acquire)) rec_capture(fs, frames);
 
-    for (size_t i = 0; i < frames; ++i) {
-        fft_push(fs[i][0]);
+    unsigned int rate = atomic_load_explicit(&p->audio->rate, memory_order_relaxed);
+    size_t pushed = resampler_feed(&p->audio->resampler, fs, frames, rate);
+    // A compare-exchange, so a reset from fft_clean_in() in between is not overwritten with the older count
+    _Atomic size_t* in_hold = &p->audio->in_hold;
+    size_t hold = atomic_load_explicit(in_hold, memory_order_relaxed);
+    while (hold > 0 && !atomic_compare_exchange_weak_explicit(in_hold, &hold, hold > pushed ? hold - pushed : 0,
+                                                              memory_order_relaxed, memory_order_relaxed)) {
     }
+    atomic_fetch_add(&p->audio->in_pos, frames);
+
+    // The callback has to finish before the device plays the buffer it was handed
+    AudioStats* stats = &p->audio->stats;
+    uint64_t elapsed = time_now_ns() - start;
+    uint64_t budget = rate > 0 ? (uint64_t)frames * 1000000000ull / rate : UINT64_MAX;
+    atomic_fetch_add_explicit(&stats->calls, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->total_ns, elapsed, memory_order_relaxed);
+    atomic_max_u64(&stats->max_ns, elapsed);
+    if (elapsed > budget) atomic_fetch_add_explicit(&stats->over_budget, 1, memory_order_relaxed);
+    trace_end(TRACE_AUDIO, "callback");
 }
 
-/* Track and Music Management */
-static Track* track_get_cur() {
-    da_get_by_idx(&p->tracks, p->cur_track);
+static void audio_stats_summary(void) {
+    AudioStats* stats = &p->audio->stats;
+    uint64_t calls = atomic_load(&stats->calls);
+    uint64_t mean = calls > 0 ? atomic_load(&stats->total_ns) / calls : 0;
+    printf("INFO: Audio callback: %lu calls, mean %.3f ms, max %.3f ms, %lu over budget\n",
+           (unsigned long)calls, mean / 1e6, atomic_load(&stats->max_ns) / 1e6, (unsigned long)atomic_load(&stats->over_budget));
+    printf("INFO: Audio feeder late refills: %lu\n", (unsigned long)atomic_load(&stats->late_refills));
 }
 
-static Track* track_get_by_id(int i) {
-    da_get_by_idx(&p->tracks, i);
+// Passes raylib's log through and picks the mixing rate out of it, raylib has no getter for the rate
+static void audio_device_log(int level, const char* text, va_list args) {
+    char line[256];
+    vsnprintf(line, sizeof(line), text, args);
+    unsigned int rate;
+    if (sscanf(line, " > Sample rate: %u", &rate) == 1) atomic_store(&p->audio->rate, rate);
+
+    const char* prefix = level >= LOG_ERROR     ? "ERROR"
+                         : level == LOG_WARNING ? "WARNING"
+                         : level == LOG_INFO    ? "INFO"
+                                                : "DEBUG";
+    printf("%s: %s\n", prefix, line);
 }
 
-static void track_swap(int i, int j) {
-    Track* track_i = track_get_by_id(i);
-    Track* track_j = track_get_by_id(j);
-    if (!track_i || !track_j) return;
+// Opened once for the life of the process, a reloaded build gets the rate through the Handoff instead
+static void audio_device_open(void) {
+    SetTraceLogCallback(audio_device_log);
+    InitAudioDevice();
+    SetTraceLogCallback(NULL);
+
+    unsigned int rate = atomic_load(&p->audio->rate);
+    if (rate == 0) {
+        fprintf(stderr, "WARNING: The audio device rate is unknown, assuming %d Hz\n", AUDIO_DEVICE_FALLBACK_RATE);
+        rate = AUDIO_DEVICE_FALLBACK_RATE;
+    }
+    audio_rate_set(rate);
+}
 
-    content_swap(track_i, track_j, sizeof(Track));
+// Every track reaches callback() at the device rate, so the resampler is built here and never on the audio thread
+static void audio_rate_set(unsigned int rate) {
+    atomic_store(&p->audio->rate, rate);
+    p->handoff.device_rate = rate;
+    resampler_init(&p->audio->resampler, rate);
+}
 
-    if (p->cur_track == i) {
-        p->cur_track = j;
-    } else if (p->cur_track == j) {
-        p->cur_track = i;
+/* Resampler */
+static unsigned int gcd(unsigned int a, unsigned int b) {
+    while (b != 0) {
+        unsigned int t = a % b;
+        a = b;
+        b = t;
     }
+    return a;
 }
 
-static void track_remove(int i) {
-    Track* track = track_get_by_id(i);
-    if (track == NULL) return;
+// Windowed-sinc low-pass on a grid of `phases` points per input sample, split into one row per phase.
+// Runs once for the device rate, see audio_rate_set()
+static void resampler_init(Resampler* r, unsigned int in_rate) {
+    unsigned int g = gcd(ANALYSIS_RATE, in_rate);
+    r->in_rate = in_rate;
+    r->up = ANALYSIS_RATE / g;
+    r->down = in_rate / g;
+    r->phases = r->up < RESAMPLE_MAX_PHASES ? r->up : RESAMPLE_MAX_PHASES;
+    r->phase = 0;
+    r->pos = RESAMPLE_TAPS - 1;
+    memset(r->x, 0, sizeof(r->x));
+
+    float ratio = fminf(1.0f, (float)ANALYSIS_RATE / in_rate);
+    float fc = RESAMPLE_CUTOFF * ratio / r->phases;  // Cycles per grid point
+    size_t len = (size_t)r->phases * RESAMPLE_TAPS;
+    float center = (len - 1) / 2.0f;
+    for (size_t ph = 0; ph < r->phases; ++ph) {
+        float sum = 0.0f;
+        for (size_t k = 0; k < RESAMPLE_TAPS; ++k) {
+            size_t n = ph + k * r->phases;
+            float t = n - center;
+            float sinc = t == 0.0f ? 1.0f : sinf(PI * 2.0f * fc * t) / (PI * 2.0f * fc * t);
+            float w = 0.42f - 0.5f * cosf(TWO_PI * n / (len - 1)) + 0.08f * cosf(2 * TWO_PI * n / (len - 1));  // Blackman
+            r->bank[ph][RESAMPLE_TAPS - 1 - k] = sinc * w;
+            sum += sinc * w;
+        }
+        // Every phase passes DC unchanged
+        for (size_t k = 0; k < RESAMPLE_TAPS; ++k) r->bank[ph][k] /= sum;
+    }
+}
 
-    DetachAudioStreamProcessor(track->music.stream, callback);
-    UnloadMusicStream(track->music);
-    free(track->file_path);
-    da_remove(&p->tracks, i);
+// Converts the n samples after the history in x into y, returns how many came out
+static size_t resampler_run(Resampler* r, size_t n) {
+    size_t count = 0;
+    while (r->pos < RESAMPLE_TAPS - 1 + n) {
+        const float* row = r->bank[(size_t)r->phase * r->phases / r->up];
+        const float* xs = &r->x[r->pos + 1 - RESAMPLE_TAPS];
 
-    if (i < p->cur_track) p->cur_track = p->cur_track - 1;
+        float acc[RESAMPLE_LANES] = {0};
+        for (size_t k = 0; k < RESAMPLE_TAPS; k += RESAMPLE_LANES) {
+            for (size_t l = 0; l < RESAMPLE_LANES; ++l) acc[l] += row[k + l] * xs[k + l];
+        }
+        float sum = 0.0f;
+        for (size_t l = 0; l < RESAMPLE_LANES; ++l) sum += acc[l];
+        r->y[count++] = sum;
+
+        r->phase += r->down;
+        r->pos += r->phase / r->up;
+        r->phase %= r->up;
+    }
+
+    // Keep the tail as the history of the next chunk
+    r->pos -= n;
+    memmove(r->x, r->x + n, (RESAMPLE_TAPS - 1) * sizeof(r->x[0]));
+    return count;
 }
 
-static void track_next_in_order() {
-    track_play((p->cur_track + 1) % p->tracks.count);
+// Input frames per resampler_run(), keeps every chunk's output within y even for rates far below ANALYSIS_RATE
+static size_t resampler_chunk(const Resampler* r) {
+    size_t chunk = (size_t)(RESAMPLE_OUT_CAPACITY - 1) * r->down / r->up;
+    return chunk < RESAMPLE_CHUNK ? chunk : RESAMPLE_CHUNK;
 }
 
-static void track_stop_play() {
-    Track* track = track_get_cur();
-    if (!track) return;
-    if (IsMusicStreamPlaying(track->music)) {
-        StopMusicStream(track->music);
-        p->music_is_paused = true;
+// Pushes the left channel into in_raw at ANALYSIS_RATE, returns the number of samples pushed
+static size_t resampler_feed(Resampler* r, float (*fs)[2], size_t frames, unsigned int rate) {
+    if (rate == 0) rate = ANALYSIS_RATE;
+    if (rate != r->in_rate) resampler_init(r, rate);
+
+    size_t chunk = resampler_chunk(r);
+
+    size_t pushed = 0;
+    for (size_t i = 0; i < frames; i += chunk) {
+        size_t n = frames - i < chunk ? frames - i : chunk;
+        float* in = r->x + RESAMPLE_TAPS - 1;
+        for (size_t j = 0; j < n; ++j) in[j] = fs[i + j][0];
+
+        if (r->up == r->down) {
+            fft_push(in, n);
+            pushed += n;
+        } else {
+            size_t count = resampler_run(r, n);
+            fft_push(r->y, count);
+            pushed += count;
+        }
     }
+    return pushed;
 }
 
-static void track_play(size_t id) {
-    if (p->tracks.count == 0) return;
-    if (id < 0 || id >= p->tracks.count) return;
+/* Multi-resolution Analysis */
+static void mr_init(MultiRes* mr, const BandMap* bm) {
+    for (size_t i = 0; i < MR_SIZE; ++i) {
+        float t = (float)i / (MR_SIZE - 1);
+        mr->hann[i] = 0.5 - 0.5 * cosf(TWO_PI * t);
+    }
 
-    Track* track = track_get_cur();
-    if (track) StopMusicStream(track->music);
-    PlayMusicStream(p->tracks.items[id].music);
-    p->cur_track = id;
-    p->music_is_paused = false;
+    // Blackman-windowed sinc cut at a quarter of the input rate, the Nyquist frequency after dropping every other sample
+    float sum = 0.0f;
+    for (size_t t = 0; t < MR_HALFBAND_TAPS; ++t) {
+        float x = (float)t - MR_HALFBAND_TAPS / 2;
+        float sinc = x == 0.0f ? 1.0f : sinf(PI * x / 2) / (PI * x / 2);
+        float w = 0.42f - 0.5f * cosf(TWO_PI * t / (MR_HALFBAND_TAPS - 1)) + 0.08f * cosf(2 * TWO_PI * t / (MR_HALFBAND_TAPS - 1));
+        mr->halfband[t] = sinc * w;
+        sum += sinc * w;
+    }
+    for (size_t t = 0; t < MR_HALFBAND_TAPS; ++t) mr->halfband[t] /= sum;
+
+    // amp() is the log of the power, which grows with the square of the window length
+    mr->gain = 2.0f * logf((float)FFT_SIZE / MR_SIZE);
+
+    // Level k bins are 2^(MR_LEVELS - 1 - k) full FFT bins wide, a band takes the widest bins that fit in it.
+    // Decimated levels only ever get bands far below their cutoff, where the half-band filter is flat
+    for (size_t b = 0; b < bm->count; ++b) {
+        uint32_t width = bm->hi[b] - bm->lo[b];
+        size_t k = MR_LEVELS - 1;
+        while (k > 0 && (1u << (MR_LEVELS - k)) <= width) k -= 1;
+        mr->level[b] = k;
+    }
+}
+
+// Level 0 is in_raw itself, level k >= 1 holds FFT_SIZE >> k samples
+static float* mr_level_input(MultiRes* mr, size_t k) {
+    if (k == 0) return p->audio->in_raw;
+    return mr->dec + FFT_SIZE - (FFT_SIZE >> (k - 1));
+}
+
+// Low-passes the n samples of `in` and keeps every other one, so the newest sample stays the last one.
+// The filter is centered on the kept sample and sees zeros past either end
+static void mr_decimate(const float h[], const float in[], size_t n, float out[]) {
+    size_t half = MR_HALFBAND_TAPS / 2;
+    for (size_t j = 0; j < n / 2; ++j) {
+        size_t c = 2 * j + 1;
+        size_t t0 = c < half ? half - c : 0;
+        size_t t1 = c + half >= n ? n + half - c : MR_HALFBAND_TAPS;
+        float sum = 0.0f;
+        for (size_t t = t0; t < t1; ++t) sum += h[t] * in[c + t - half];
+        out[j] = sum;
+    }
+}
+
+// The same stages as the FFT engine: decimation and windowing, then MR_LEVELS short transforms into out_raw,
+// then only the bins of every band at its level. Returns the band count
+static size_t mr_proccess(float bands[]) {
+    MultiRes* mr = &p->analysis->mr;
+
+    prof_begin(PROF_FFT_WINDOW);
+    for (size_t k = 1; k < MR_LEVELS; ++k) {
+        mr_decimate(mr->halfband, mr_level_input(mr, k - 1), FFT_SIZE >> (k - 1), mr_level_input(mr, k));
+    }
+    for (size_t k = 0; k < MR_LEVELS; ++k) {
+        const float* in = mr_level_input(mr, k) + (FFT_SIZE >> k) - MR_SIZE;
+        float* windowed = p->analysis->in_windowed + k * MR_SIZE;
+        for (size_t i = 0; i < MR_SIZE; ++i) windowed[i] = in[i] * mr->hann[i];
+    }
+    prof_end(PROF_FFT_WINDOW);
+
+    prof_begin(PROF_FFT_TRANSFORM);
+    for (size_t k = 0; k < MR_LEVELS; ++k) {
+        fft(p->analysis->in_windowed + k * MR_SIZE, 1, p->analysis->out_raw + k * MR_SIZE, MR_SIZE);
+    }
+    prof_end(PROF_FFT_TRANSFORM);
+
+    prof_begin(PROF_FFT_REDUCE);
+    const BandMap* bm = &p->analysis->bands;
+    for (size_t b = 0; b < bm->count; ++b) {
+        size_t k = mr->level[b];
+        size_t shift = MR_LEVELS - 1 - k;
+        const float complex* out = p->analysis->out_raw + k * MR_SIZE;
+        size_t q1 = (bm->hi[b] + (1u << shift) - 1) >> shift;
+
+        float ampl = 0.0f;
+        for (size_t q = bm->lo[b] >> shift; q < q1; ++q) {
+            ampl = fmaxf(ampl, amp(out[q]) + mr->gain);
+        }
+        bands[b] = ampl;
+    }
+    fft_normalize(bands, bm->count);
+    prof_end(PROF_FFT_REDUCE);
+
+    return bm->count;
+}
+
+/* Sliding DFT */
+// The widest bins that still fit in a band of `width` full FFT bins
+static size_t sdft_group(uint32_t width) {
+    size_t g = 0;
+    while (g + 1 < SDFT_GROUPS && (2u << g) <= width) g += 1;
+    return g;
+}
+
+// Builds the resonator tables for the bands, the running sums are left alone
+static void sdft_tables(Sdft* s, const BandMap* bm) {
+    // Every band reads the bin nearest to its center and the two next to it, for the Hann window
+    bool needed[FFT_SIZE / 2 + 2];
+    size_t count = 0;
+    for (size_t g = 0; g < SDFT_GROUPS; ++g) {
+        memset(needed, 0, sizeof(needed));
+        for (size_t b = 0; b < bm->count; ++b) {
+            if (sdft_group(bm->hi[b] - bm->lo[b]) != g) continue;
+            size_t k = lroundf((bm->lo[b] + bm->hi[b] - 1) / 2.0f / (1u << g));
+            needed[k - 1] = needed[k] = needed[k + 1] = true;
+        }
+
+        size_t n = FFT_SIZE >> g;
+        s->start[g] = count;
+        for (size_t k = 0; k < ARRAY_LEN(needed); ++k) {
+            if (!needed[k]) continue;
+            assert(count < SDFT_CAPACITY && "ERROR: Increase SDFT_CAPACITY");
+            s->zr[count] = SDFT_DAMPING * cos(TWO_PI * k / n);
+            s->zi[count] = -SDFT_DAMPING * sin(TWO_PI * k / n);
+            // From the rounded z, so the sample leaving the window cancels what entering added. The exact
+            // SDFT_DAMPING^N is off by a rotation of N rounding errors, and the leftovers pile up on long windows
+            double complex zn = cpow(CMPLX(s->zr[count], s->zi[count]), n);
+            s->zNr[count] = creal(zn);
+            s->zNi[count] = cimag(zn);
+            count += 1;
+        }
+        s->gain[g] = 2.0f * logf((float)(1u << g));  // amp() is the log of the power, like in mr_init()
+
+        // The center resonator comes after one resonator for every needed bin below it
+        for (size_t b = 0; b < bm->count; ++b) {
+            if (sdft_group(bm->hi[b] - bm->lo[b]) != g) continue;
+            size_t k = lroundf((bm->lo[b] + bm->hi[b] - 1) / 2.0f / (1u << g));
+            size_t r = s->start[g];
+            for (size_t j = 0; j < k; ++j) r += needed[j];
+            s->band_res[b] = r;
+        }
+    }
+    s->start[SDFT_GROUPS] = count;
+}
+
+static void sdft_init(Sdft* s, const BandMap* bm) {
+    sdft_tables(s, bm);
+    atomic_store(&s->reset, true);
+}
+
+// Runs on the audio thread before the block enters in_raw. For every sample, and every resonator of a group:
+// S = z * S + x[n] - z^N * x[n - N]
+static void sdft_push(Sdft* s, const float frames[], size_t n) {
+    if (atomic_exchange(&s->reset, false)) {
+        memset(s->re, 0, sizeof(s->re));
+        memset(s->im, 0, sizeof(s->im));
+        s->filled = 0;
+    }
+
+    for (size_t g = 0; g < SDFT_GROUPS; ++g) {
+        size_t len = FFT_SIZE >> g;
+        size_t r0 = s->start[g];
+        size_t r1 = s->start[g + 1];
+        for (size_t i = 0; i < n; ++i) {
+            // Sample i sits at FFT_SIZE + i past the start of in_raw
+            float old = 0.0f;
+            if (s->filled + i >= len) old = i < len ? p->audio->in_raw[FFT_SIZE - len + i] : frames[i - len];
+            float x = frames[i];
+
+            for (size_t r = r0; r < r1; ++r) {
+                float re = s->re[r];
+                float im = s->im[r];
+                s->re[r] = s->zr[r] * re - s->zi[r] * im + x - s->zNr[r] * old;
+                s->im[r] = s->zr[r] * im + s->zi[r] * re - s->zNi[r] * old;
+            }
+        }
+    }
+    s->filled += n;
+}
+
+// Reads the resonators the audio thread keeps current, a hop costs O(bands) however many samples it spans.
+// The Hann window is applied in the frequency domain: 0.5 * S[k] - 0.25 * (S[k - 1] + S[k + 1])
+static size_t sdft_proccess(float bands[]) {
+    Sdft* s = &p->audio->sdft;
+
+    prof_begin(PROF_FFT_REDUCE);
+    const BandMap* bm = &p->analysis->bands;
+    for (size_t b = 0; b < bm->count; ++b) {
+        size_t r = s->band_res[b];
+        float re = 0.5f * s->re[r] - 0.25f * (s->re[r - 1] + s->re[r + 1]);
+        float im = 0.5f * s->im[r] - 0.25f * (s->im[r - 1] + s->im[r + 1]);
+        bands[b] = fmaxf(0.0f, amp(CMPLXF(re, im)) + s->gain[sdft_group(bm->hi[b] - bm->lo[b])]);
+    }
+    fft_normalize(bands, bm->count);
+    prof_end(PROF_FFT_REDUCE);
+
+    return bm->count;
+}
+
+/* Parallel FFT */
+static void pfft_pool_init(FftPool* pool, size_t threads, size_t capacity) {
+    memset(pool, 0, sizeof(*pool));
+    pool->threads = threads;
+    if (threads <= 1) return;
+
+    pool->capacity = capacity;
+    da_malloc(pool->tw, capacity);
+    da_malloc(pool->y, capacity);
+    da_malloc(pool->z, capacity);
+    for (size_t j = 0; j < capacity; ++j) {
+        pool->tw[j] = cexp(-2 * I * PI * j / capacity);
+    }
+
+    pthread_barrier_init(&pool->start, NULL, threads);
+    pthread_barrier_init(&pool->step, NULL, threads);
+    pthread_barrier_init(&pool->done, NULL, threads);
+    da_malloc(pool->workers, threads);
+    for (size_t i = 1; i < threads; ++i) {
+        if (pthread_create(&pool->workers[i], NULL, pfft_thread, pool) != 0) {
+            fprintf(stderr, "ERROR: Failed to create thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void pfft_pool_free(FftPool* pool) {
+    if (pool->threads > 1) {
+        pool->stop = true;
+        pthread_barrier_wait(&pool->start);
+        for (size_t i = 1; i < pool->threads; ++i) pthread_join(pool->workers[i], NULL);
+        pthread_barrier_destroy(&pool->start);
+        pthread_barrier_destroy(&pool->step);
+        pthread_barrier_destroy(&pool->done);
+        FREE(pool->workers);
+        FREE(pool->tw);
+        FREE(pool->y);
+        FREE(pool->z);
+    }
+    memset(pool, 0, sizeof(*pool));
+}
+
+// Rows [r0, r1) of the real rows x cols matrix `in` into the columns of `out`
+static void pfft_transpose_in(const float in[], float complex out[], size_t rows, size_t cols, size_t r0, size_t r1) {
+    for (size_t c0 = 0; c0 < cols; c0 += PFFT_TILE) {
+        size_t c1 = c0 + PFFT_TILE < cols ? c0 + PFFT_TILE : cols;
+        for (size_t r = r0; r < r1; ++r) {
+            for (size_t c = c0; c < c1; ++c) out[c * rows + r] = in[r * cols + c];
+        }
+    }
+}
+
+// Rows [r0, r1) of the rows x cols matrix `in` into the columns of `out`. A whole column of `out` would touch a
+// cache line per element, a PFFT_TILE wide strip of them stays in cache until every row of the tile is written
+static void pfft_transpose(const float complex in[], float complex out[], size_t rows, size_t cols, size_t r0, size_t r1) {
+    for (size_t c0 = 0; c0 < cols; c0 += PFFT_TILE) {
+        size_t c1 = c0 + PFFT_TILE < cols ? c0 + PFFT_TILE : cols;
+        for (size_t r = r0; r < r1; ++r) {
+            for (size_t c = c0; c < c1; ++c) out[c * rows + r] = in[r * cols + c];
+        }
+    }
+}
+
+// Input index n1 + n1_count * n2 and output index n2_count * k1 + k2:
+// X[k1, k2] = sum over n1 of W_N1^(n1 k1) * W_N^(n1 k2) * (sum over n2 of x[n1, n2] * W_N2^(n2 k2))
+static void pfft_step(FftPool* pool, PfftStep step) {
+    size_t n1 = pool->n1;
+    size_t n2 = pool->n2;
+
+    size_t count = 0;
+    switch (step) {
+    case PFFT_TRANSPOSE_IN: count = (n2 + PFFT_TILE - 1) / PFFT_TILE; break;
+    case PFFT_ROWS: count = n1; break;
+    case PFFT_TRANSPOSE_MID: count = (n1 + PFFT_TILE - 1) / PFFT_TILE; break;
+    case PFFT_COLS: count = n2; break;
+    case PFFT_TRANSPOSE_OUT: count = (n2 + PFFT_TILE - 1) / PFFT_TILE; break;
+    default: break;
+    }
+
+    for (size_t task; (task = atomic_fetch_add(&pool->next[step], 1)) < count;) {
+        size_t r0 = task * PFFT_TILE;
+        switch (step) {
+        case PFFT_TRANSPOSE_IN:
+            pfft_transpose_in(pool->in, pool->z, n2, n1, r0, r0 + PFFT_TILE < n2 ? r0 + PFFT_TILE : n2);
+            break;
+
+        case PFFT_ROWS: {
+            float complex* row = pool->y + task * n2;
+            fft_complex(pool->z + task * n2, 1, row, n2);
+            size_t tw_step = pool->capacity / pool->n;
+            for (size_t k2 = 1; k2 < n2; ++k2) row[k2] *= pool->tw[task * k2 * tw_step];
+        } break;
+
+        case PFFT_TRANSPOSE_MID:
+            pfft_transpose(pool->y, pool->z, n1, n2, r0, r0 + PFFT_TILE < n1 ? r0 + PFFT_TILE : n1);
+            break;
+
+        case PFFT_COLS:
+            fft_complex(pool->z + task * n1, 1, pool->y + task * n1, n1);
+            break;
+
+        case PFFT_TRANSPOSE_OUT:
+            pfft_transpose(pool->y, pool->out, n2, n1, r0, r0 + PFFT_TILE < n2 ? r0 + PFFT_TILE : n2);
+            break;
+
+        default:
+            break;
+        }
+    }
+}
+
+static void pfft_steps(FftPool* pool) {
+    for (PfftStep step = 0; step < COUNT_PFFT_STEPS; ++step) {
+        pfft_step(pool, step);
+        pthread_barrier_wait(&pool->step);
+    }
+}
+
+static void* pfft_thread(void* arg) {
+    FftPool* pool = arg;
+    sched_apply(SCHED_ROLE_ANALYSIS);
+    for (;;) {
+        pthread_barrier_wait(&pool->start);
+        if (pool->stop) break;
+        pfft_steps(pool);
+        pthread_barrier_wait(&pool->done);
+    }
+    return NULL;
+}
+
+// Same result as fft(in, 1, out, n) for a power of two n up to the pool capacity
+static void pfft(FftPool* pool, float in[], float complex out[], size_t n) {
+    if (pool->threads <= 1 || n < PFFT_MIN_SIZE) {
+        fft(in, 1, out, n);
+        return;
+    }
+    assert(n <= pool->capacity);
+
+    pool->in = in;
+    pool->out = out;
+    pool->n = n;
+    pool->n1 = 1;
+    while (pool->n1 * pool->n1 < n) pool->n1 *= 2;
+    pool->n2 = n / pool->n1;
+    for (PfftStep step = 0; step < COUNT_PFFT_STEPS; ++step) atomic_store(&pool->next[step], 0);
+
+    pthread_barrier_wait(&pool->start);
+    pfft_steps(pool);
+    pthread_barrier_wait(&pool->done);
+}
+
+/* Audio Feeder */
+static void* audio_feeder_thread(void* arg) {
+    (void)arg;
+    sched_apply(SCHED_ROLE_FEEDER);
+    printf("INFO: Audio Feeder Thread started\n");
+
+    double last_refill = time_now();
+    double last_seek = 0.0;
+    while (!atomic_load(&p->feeder_stop)) {
+        pthread_mutex_lock(&p->audio_mutex);
+        {
+            Music* music = track_get_cur();
+            double now = time_now();
+
+            // Only the latest requested position is applied, at most once per coalescing interval
+            if (music && p->seek_pending >= 0.0f && now - last_seek >= SEEK_COALESCE_SECS) {
+                SeekMusicStream(*music, p->seek_pending);
+                fft_clean_in();
+                atomic_store(&p->audio->in_pos, (uint64_t)(p->seek_pending * atomic_load(&p->audio->rate)));
+                p->seek_pending = -1.0f;
+                last_seek = now;
+            }
+
+            if (music && IsMusicStreamPlaying(*music)) {
+                // The device drains one sub-buffer while the other one waits to be refilled
+                double budget = (double)AUDIO_STREAM_BUFFER_FRAMES / music->stream.sampleRate;
+                if (now - last_refill > budget) {
+                    atomic_fetch_add(&p->audio->stats.late_refills, 1);
+                    trace_counter(TRACE_FEEDER, "late_refills", atomic_load(&p->audio->stats.late_refills));
+                }
+
+                SetMusicVolume(*music, p->volume);
+                prof_begin(PROF_UPDATE_MUSIC);
+                UpdateMusicStream(*music);
+                prof_end(PROF_UPDATE_MUSIC);
+            }
+            last_refill = now;
+        }
+        pthread_mutex_unlock(&p->audio_mutex);
+
+        time_sleep(AUDIO_FEEDER_SLEEP_SECS);
+    }
+
+    printf("INFO: Audio Feeder Thread stopped\n");
+    pthread_exit(NULL);
+}
+
+static void audio_feeder_start(void) {
+    atomic_store(&p->feeder_stop, false);
+    if (pthread_create(&p->feeder, NULL, audio_feeder_thread, NULL) != 0) {
+        fprintf(stderr, "ERROR: Failed to create thread\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void audio_feeder_stop(void) {
+    atomic_store(&p->feeder_stop, true);
+    pthread_join(p->feeder, NULL);
+}
+
+/* Spectrum Export */
+// Creates the shared object other processes map read-only, see shm.h for the layout and how to read it
+static void shm_export_open(const char* name) {
+    snprintf(p->shm_name, sizeof(p->shm_name), "%s%s", name[0] == '/' ? "" : "/", name);
+    int fd = shm_open(p->shm_name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Could not create shared memory %s: %s\n", p->shm_name, strerror(errno));
+        return;
+    }
+    void* data = MAP_FAILED;
+    if (ftruncate(fd, sizeof(ShmSpectrum)) == 0) {
+        data = mmap(NULL, sizeof(ShmSpectrum), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Could not map shared memory %s: %s\n", p->shm_name, strerror(errno));
+        shm_unlink(p->shm_name);
+        return;
+    }
+
+    // A previous run may have died inside a frame and left its sequence odd
+    ShmSpectrum* shm = data;
+    memset(shm, 0, sizeof(*shm));
+    shm->version = SHM_VERSION;
+    shm->ring_frames = SHM_RING_FRAMES;
+    shm->max_bands = SHM_MAX_BANDS;
+    atomic_thread_fence(memory_order_release);
+    memcpy(shm->magic, SHM_MAGIC, sizeof(shm->magic));
+
+    p->shm = shm;
+    p->analysis->shm_pos = UINT64_MAX;
+    printf("INFO: Exporting the spectrum to shared memory %s\n", p->shm_name);
+}
+
+static void shm_export_close(void) {
+    if (p->shm == NULL) return;
+    munmap(p->shm, sizeof(*p->shm));
+    shm_unlink(p->shm_name);
+    p->shm = NULL;
+}
+
+// Runs on the analysis thread, the only writer of the spectrum, right after it is published to the render thread.
+// The analysis spins on the same window until new audio arrives, those repeats are not exported
+static void shm_export_publish(void) {
+    ShmSpectrum* shm = p->shm;
+    if (shm == NULL || p->analysis->out_pos == p->analysis->shm_pos) return;
+
+    uint64_t n = atomic_load_explicit(&shm->latest, memory_order_relaxed);
+    ShmFrame* f = &shm->frames[n % SHM_RING_FRAMES];
+    uint32_t seq = atomic_load_explicit(&f->seq, memory_order_relaxed);
+    atomic_store_explicit(&f->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    size_t count = p->analysis->freq_count < SHM_MAX_BANDS ? p->analysis->freq_count : SHM_MAX_BANDS;
+    f->band_count = count;
+    f->frame = n;
+    f->audio_pos = p->analysis->out_pos;
+    f->sample_rate = atomic_load(&p->audio->rate);  // The device's, the rate out_pos counts in
+    memcpy(f->bands, p->analysis->out_logscaled, count * sizeof(f->bands[0]));
+    memcpy(f->smoothed, p->analysis->out_smoothed, count * sizeof(f->smoothed[0]));
+    memcpy(f->smeared, p->analysis->out_smeared, count * sizeof(f->smeared[0]));
+
+    atomic_store_explicit(&f->seq, seq + 2, memory_order_release);
+    atomic_store_explicit(&shm->latest, n + 1, memory_order_release);
+    p->analysis->shm_pos = p->analysis->out_pos;
+}
+
+/* Scheduling */
+// A list like 0,2-3, false when it is malformed or names no CPU
+static bool sched_parse_cpus(const char* list, cpu_set_t* cpus) {
+    CPU_ZERO(cpus);
+    const char* c = list;
+    while (*c != '\0') {
+        char* end = NULL;
+        long first = strtol(c, &end, 10);
+        if (end == c || first < 0) return false;
+        long last = first;
+        if (*end == '-') {
+            c = end + 1;
+            last = strtol(c, &end, 10);
+            if (end == c || last < first) return false;
+        }
+        if (last >= CPU_SETSIZE) return false;
+        for (long cpu = first; cpu <= last; ++cpu) CPU_SET(cpu, cpus);
+
+        if (*end == ',') end += 1;
+        else if (*end != '\0') return false;
+        c = end;
+    }
+    return CPU_COUNT(cpus) > 0;
+}
+
+static void sched_format_cpus(const cpu_set_t* cpus, char* out, size_t size) {
+    size_t len = 0;
+    out[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE && len < size; ++cpu) {
+        if (!CPU_ISSET(cpu, cpus)) continue;
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, cpus)) last += 1;
+        if (last == cpu) {
+            len += snprintf(out + len, size - len, "%s%d", len > 0 ? "," : "", cpu);
+        } else {
+            len += snprintf(out + len, size - len, "%s%d-%d", len > 0 ? "," : "", cpu, last);
+        }
+        cpu = last;
+    }
+}
+
+static const char* sched_policy_name(int policy) {
+    switch (policy) {
+    case SCHED_FIFO: return "SCHED_FIFO";
+    case SCHED_RR: return "SCHED_RR";
+    default: return "SCHED_OTHER";
+    }
+}
+
+// The feeder asks for SCHED_FIFO by default and background jobs for a higher nice, everything else stays as is
+static void sched_load(void) {
+    for (SchedRole role = 0; role < COUNT_SCHED_ROLES; ++role) {
+        SchedConfig* c = &p->sched[role];
+        c->loaded = true;
+        c->pinned = false;
+        c->policy = role == SCHED_ROLE_FEEDER ? SCHED_FIFO : SCHED_OTHER;
+        c->priority = role == SCHED_ROLE_FEEDER ? AUDIO_FEEDER_PRIORITY : 1;
+        c->nice = role == SCHED_ROLE_BACKGROUND ? SCHED_BACKGROUND_NICE : 0;
+        atomic_store(&c->reported, false);
+
+        char prefix[32];
+        size_t len = snprintf(prefix, sizeof(prefix), "%s%s_", SCHED_ENV_PREFIX, sched_role_names[role]);
+        for (size_t i = 0; i < len; ++i) prefix[i] = toupper(prefix[i]);
+        char name[64];
+
+        snprintf(name, sizeof(name), "%sCPUS", prefix);
+        const char* cpus = getenv(name);
+        if (cpus != NULL && *cpus != '\0') {
+            c->pinned = sched_parse_cpus(cpus, &c->cpus);
+            if (!c->pinned) fprintf(stderr, "WARNING: %s=%s is not a CPU list like 0,2-3\n", name, cpus);
+        }
+
+        snprintf(name, sizeof(name), "%sPOLICY", prefix);
+        const char* policy = getenv(name);
+        if (policy != NULL && *policy != '\0') {
+            if (strcmp(policy, "other") == 0) {
+                c->policy = SCHED_OTHER;
+            } else if (strcmp(policy, "fifo") == 0) {
+                c->policy = SCHED_FIFO;
+            } else if (strcmp(policy, "rr") == 0) {
+                c->policy = SCHED_RR;
+            } else {
+                fprintf(stderr, "WARNING: %s=%s is not one of other, fifo or rr\n", name, policy);
+            }
+        }
+
+        snprintf(name, sizeof(name), "%sPRIORITY", prefix);
+        c->priority = env_long(name, c->priority);
+        snprintf(name, sizeof(name), "%sNICE", prefix);
+        c->nice = env_long(name, c->nice);
+    }
+}
+
+// Every thread of a role calls this on itself before anything else. Real-time policies need CAP_SYS_NICE or an
+// RLIMIT_RTPRIO, and a lower nice needs CAP_SYS_NICE too, without them the thread goes on as before.
+// The first thread of every role reports what it got
+static void sched_apply(SchedRole role) {
+    SchedConfig* c = &p->sched[role];
+    if (!c->loaded) return;  // The windowless modes keep the defaults
+    pthread_t self = pthread_self();
+
+    char cpus[128] = "any";
+    if (c->pinned) {
+        if (pthread_setaffinity_np(self, sizeof(c->cpus), &c->cpus) == 0) {
+            sched_format_cpus(&c->cpus, cpus, sizeof(cpus));
+        } else {
+            snprintf(cpus, sizeof(cpus), "any, could not pin");
+        }
+    }
+
+    int policy = c->policy;
+    struct sched_param param = {.sched_priority = policy == SCHED_OTHER ? 0 : c->priority};
+    if (pthread_setschedparam(self, policy, &param) != 0) {
+        policy = SCHED_OTHER;
+        param.sched_priority = 0;
+        pthread_setschedparam(self, policy, &param);
+    }
+
+    int nice = 0;
+    if (policy == SCHED_OTHER && c->nice != 0 && setpriority(PRIO_PROCESS, gettid(), c->nice) == 0) nice = c->nice;
+
+    if (atomic_exchange(&c->reported, true)) return;
+    if (policy != c->policy) {
+        printf("WARNING: Scheduling %s: %s %d is not permitted, running %s\n", sched_role_names[role],
+               sched_policy_name(c->policy), c->priority, sched_policy_name(policy));
+    }
+    if (nice != c->nice && policy == SCHED_OTHER) {
+        printf("WARNING: Scheduling %s: nice %d is not permitted\n", sched_role_names[role], c->nice);
+    }
+    if (policy == SCHED_OTHER) {
+        printf("INFO: Scheduling %s: %s, nice %d, cpus %s\n", sched_role_names[role], sched_policy_name(policy), nice, cpus);
+    } else {
+        printf("INFO: Scheduling %s: %s %d, cpus %s\n", sched_role_names[role], sched_policy_name(policy), param.sched_priority, cpus);
+    }
+}
+
+/* Track and Music Management */
+#undef MEM_TAG
+#define MEM_TAG MEM_TRACKS
+static void tracks_reserve(Tracks* ts, size_t n) {
+    if (n <= ts->capacity) return;
+
+    if (ts->capacity == 0) ts->capacity = DA_INIT_CAP;
+    while (n > ts->capacity) ts->capacity *= 2;
+
+    ts->music = REALLOC(ts->music, ts->capacity * sizeof(*ts->music));
+    ts->files = REALLOC(ts->files, ts->capacity * sizeof(*ts->files));
+    ts->order = REALLOC(ts->order, ts->capacity * sizeof(*ts->order));
+    ts->where = REALLOC(ts->where, ts->capacity * sizeof(*ts->where));
+    ASSERT(ts->music != NULL && ts->files != NULL && "ERROR: Not enough RAM");
+    ASSERT(ts->order != NULL && ts->where != NULL && "ERROR: Not enough RAM");
+}
+
+static void tracks_free(Tracks* ts) {
+    FREE(ts->music);
+    FREE(ts->files);
+    FREE(ts->order);
+    FREE(ts->where);
+    da_free(&ts->paths);
+}
+
+static void tracks_push(Tracks* ts, Music music, const char* file_path, unsigned char* file_data, size_t file_size) {
+    size_t slot = ts->count;
+    tracks_reserve(ts, slot + 1);
+    ts->music[slot] = music;
+    ts->files[slot] = (TrackFile){.path = ts->paths.count, .file_data = file_data, .file_size = file_size};
+    ts->order[slot] = slot;
+    ts->where[slot] = slot;
+    da_append_many(&ts->paths, file_path, strlen(file_path) + 1);
+    ts->count++;
+}
+
+static void tracks_compact_paths(Tracks* ts) {
+    Chars paths = {0};
+    for (size_t slot = 0; slot < ts->count; ++slot) {
+        const char* path = ts->paths.items + ts->files[slot].path;
+        ts->files[slot].path = paths.count;
+        da_append_many(&paths, path, strlen(path) + 1);
+    }
+    da_free(&ts->paths);
+    ts->paths = paths;
+    ts->paths_waste = 0;
+}
+
+static Music* track_get_cur() {
+    return track_get_by_id(p->cur_track);
+}
+
+static Music* track_get_by_id(int i) {
+    if (i < 0 || (size_t)i >= p->tracks.count) return NULL;
+    return &p->tracks.music[p->tracks.order[i]];
+}
+
+static const char* track_get_path(int i) {
+    if (i < 0 || (size_t)i >= p->tracks.count) return NULL;
+    return p->tracks.paths.items + p->tracks.files[p->tracks.order[i]].path;
+}
+
+static void track_swap(int i, int j) {
+    if (!track_get_by_id(i) || !track_get_by_id(j)) return;
+
+    pthread_mutex_lock(&p->audio_mutex);
+    Tracks* ts = &p->tracks;
+    uint32_t slot_i = ts->order[i];
+    ts->order[i] = ts->order[j];
+    ts->order[j] = slot_i;
+    ts->where[ts->order[i]] = i;
+    ts->where[ts->order[j]] = j;
+
+    if (p->cur_track == i) {
+        p->cur_track = j;
+    } else if (p->cur_track == j) {
+        p->cur_track = i;
+    }
+    pthread_mutex_unlock(&p->audio_mutex);
+}
+
+static void track_remove(int i) {
+    if (track_get_by_id(i) == NULL) return;
+
+    pthread_mutex_lock(&p->audio_mutex);
+    Tracks* ts = &p->tracks;
+    size_t slot = ts->order[i];
+    size_t last = ts->count - 1;
+    track_unload(slot);
+
+    // Close the gap in the playlist order
+    memmove(ts->order + i, ts->order + i + 1, (ts->count - i - 1) * sizeof(ts->order[0]));
+    for (size_t k = i; k < last; ++k) ts->where[ts->order[k]] = k;
+
+    // Move the last slot into the freed one to keep the slot arrays dense
+    if (slot != last) {
+        ts->music[slot] = ts->music[last];
+        ts->files[slot] = ts->files[last];
+        ts->where[slot] = ts->where[last];
+        ts->order[ts->where[slot]] = slot;
+    }
+    ts->count--;
+    shuffle_remove(&p->shuffle, slot, last);
+
+    if (ts->paths_waste > ts->paths.count / 2) tracks_compact_paths(ts);
+    if (i < p->cur_track) p->cur_track = p->cur_track - 1;
+    pthread_mutex_unlock(&p->audio_mutex);
+}
+
+static void track_next_in_order() {
+    track_play((p->cur_track + 1) % p->tracks.count);
+}
+
+static void track_stop_play() {
+    Music* music = track_get_cur();
+    if (!music) return;
+
+    pthread_mutex_lock(&p->audio_mutex);
+    if (IsMusicStreamPlaying(*music)) {
+        StopMusicStream(*music);
+        p->music_is_paused = true;
+    }
+    pthread_mutex_unlock(&p->audio_mutex);
+}
+
+static void track_play(size_t id) {
+    if (p->tracks.count == 0) return;
+    if (id < 0 || id >= p->tracks.count) return;
+
+    pthread_mutex_lock(&p->audio_mutex);
+    Music* music = track_get_cur();
+    if (music) StopMusicStream(*music);
+    PlayMusicStream(*track_get_by_id(id));
+    atomic_store(&p->audio->in_pos, 0);
+    p->seek_pending = -1.0f;
+    p->cur_track = id;
+    p->music_is_paused = false;
+    shuffle_jump(&p->shuffle, p->tracks.order[id]);
+    pthread_mutex_unlock(&p->audio_mutex);
+
+    spec_open(track_get_path(id));
+    peaks_open(track_get_path(id));
+
+    if (p->mode & MODE_SHUFFLE) {
+        int next = shuffle_next(&p->shuffle);
+        if (next >= 0) track_prefetch(p->tracks.where[next]);
+    } else {
+        track_prefetch((id + 1) % p->tracks.count);
+    }
 }
 
 static void track_next_handle(bool by_user) {
     size_t tracks_cnt = p->tracks.count;
     size_t cur_track = p->cur_track;
     bool is_last = cur_track == tracks_cnt - 1 || tracks_cnt == 1;
-    Track* track = track_get_cur();
-    if (!track) return;
+    Music* music = track_get_cur();
+    if (!music) return;
 
+    pthread_mutex_lock(&p->audio_mutex);
     switch (p->mode) {
         case MODE_REPEAT1_SHUFFLE:
-            if (is_last) {
-                if (by_user) {
-                    track_stop_play();
-                } else {
-                    PlayMusicStream(track->music);
-                    p->music_is_paused = false;
-                }
+            if (by_user) {
+                track_next_shuffle(true);
             } else {
-                if (by_user) {
-                    track_next_shuffle();
-                } else {
-                    PlayMusicStream(track->music);
-                    p->music_is_paused = false;
-                }
+                PlayMusicStream(*music);
+                p->music_is_paused = false;
             }
             break;
         case MODE_REPEAT1:
@@ -640,7 +2618,7 @@ static void track_next_handle(bool by_user) {
                 if (by_user) {
                     track_next_in_order();
                 } else {
-                    PlayMusicStream(track->music);
+                    PlayMusicStream(*music);
                     p->music_is_paused = false;
                 }
             }
@@ -648,8 +2626,11 @@ static void track_next_handle(bool by_user) {
         case MODE_REPEAT:
             track_next_in_order();
             break;
+        case MODE_REPEAT_SHUFFLE:
+            track_next_shuffle(true);
+            break;
         case MODE_SHUFFLE:
-            track_next_shuffle();
+            track_next_shuffle(false);
             break;
         default:
             if (is_last) {
@@ -659,90 +2640,151 @@ static void track_next_handle(bool by_user) {
             }
             break;
     }
+    pthread_mutex_unlock(&p->audio_mutex);
 }
 
 static void track_prev_handle() {
-    Track* track = track_get_cur();
-    if (!track) return;
+    Music* music = track_get_cur();
+    if (!music) return;
 
-    if (GetMusicTimePlayed(track->music) < 5.0f && p->tracks.count > 1) {
+    pthread_mutex_lock(&p->audio_mutex);
+    if (GetMusicTimePlayed(*music) < 5.0f && p->tracks.count > 1) {
         if ((p->mode & MODE_SHUFFLE && !(p->mode & MODE_REPEAT1)) || p->cur_track > 0) {
             track_prev();
         } else {
             if (p->mode & MODE_REPEAT) {
                 track_play(p->cur_track - 1);
             } else {
-                SeekMusicStream(track->music, 0.0f);
+                track_seek(0.0f);
             }
         }
     } else {
-        SeekMusicStream(track->music, 0.0f);
+        track_seek(0.0f);
     }
+    pthread_mutex_unlock(&p->audio_mutex);
 }
 
 static void track_prev() {
-    if (p->cur_track == 0) {
+    if (p->mode & MODE_SHUFFLE) {
+        int prev = shuffle_prev(&p->shuffle);
+        if (prev < 0) {
+            track_seek(0.0f);
+        } else {
+            track_play(p->tracks.where[prev]);
+        }
+    } else if (p->cur_track == 0) {
         track_stop_play();
     } else {
         track_play(p->cur_track - 1);
     }
 }
 
-static void track_next_shuffle() {
-    if (p->tracks.count == 1) return;
+static void track_next_shuffle(bool repeat) {
+    int next = shuffle_next(&p->shuffle);
+    if (next < 0 && repeat) {
+        shuffle_restart(&p->shuffle);
+        next = shuffle_next(&p->shuffle);
+        if (next < 0) next = p->tracks.order[p->cur_track];
+    }
 
-    int i = p->cur_track;
-    while (i == p->cur_track) i = GetRandomValue(0, p->tracks.count - 1);
-    track_play(i);
+    if (next < 0) {
+        track_stop_play();
+    } else {
+        track_play(p->tracks.where[next]);
+    }
 }
 
 static bool track_exists(const char* file_path) {
-    for (size_t i = 0; i < p->tracks.count; ++i) {
-        Track* track = &p->tracks.items[i];
-        if (strcmp(track->file_path, file_path) == 0) return true;
+    for (size_t slot = 0; slot < p->tracks.count; ++slot) {
+        if (strcmp(p->tracks.paths.items + p->tracks.files[slot].path, file_path) == 0) return true;
     }
     return false;
 }
 
-static void track_add(char* file_path) {
-    Music music = LoadMusicStream(file_path);
+static void track_add(const char* file_path) {
+    Music music;
+    size_t file_size = 0;
+    unsigned char* file_data = file_map(file_path, &file_size);
+
+    if (file_data != NULL && file_size <= INT_MAX) {
+        // Decode straight from the page cache, the mapping lives as long as the track
+        madvise(file_data, file_size, MADV_SEQUENTIAL);
+        music = LoadMusicStreamFromMemory(GetFileExtension(file_path), file_data, (int)file_size);
+    } else {
+        if (file_data != NULL) munmap(file_data, file_size);
+        file_data = NULL;
+        file_size = 0;
+        music = LoadMusicStream(file_path);
+    }
     music.looping = false;
 
     if (IsMusicReady(music)) {
         SetMusicVolume(music, p->volume);
         AttachAudioStreamProcessor(music.stream, callback);
-        da_append(&p->tracks, (CLITERAL(Track){.file_path = file_path, .music = music}));
+        pthread_mutex_lock(&p->audio_mutex);
+        tracks_push(&p->tracks, music, file_path, file_data, file_size);
+        shuffle_add(&p->shuffle);
+        pthread_mutex_unlock(&p->audio_mutex);
     } else {
-        char* msg = get_track_name(file_path);
+        if (file_data != NULL) munmap(file_data, file_size);
+        // Not from the frame arena, a dropped folder can fail thousands of files in one frame
+        char msg[POPUP_MSG_CAPACITY];
+        snprintf(msg, sizeof(msg) - 3, "%s", GetFileName(file_path));  // Room for the "..." of str_fit_width()
+        remove_extension(msg);
         str_fit_width(msg, HUD_POPUP_WIDTH, HUD_POPUP_FONT_SIZE, HUD_POPUP_PAD);
-        char* header = strdup("Could not load the track");
-        popups_push(&p->popups, header, msg);
-        free(file_path);
+        popups_push(&p->popups, "Could not load the track", msg);
     }
 }
 
+static void track_unload(size_t slot) {
+    Music music = p->tracks.music[slot];
+    TrackFile* file = &p->tracks.files[slot];
+    DetachAudioStreamProcessor(music.stream, callback);
+    UnloadMusicStream(music);
+    if (file->file_data != NULL) munmap(file->file_data, file->file_size);
+    p->tracks.paths_waste += strlen(p->tracks.paths.items + file->path) + 1;
+}
+
+static void track_seek(float secs) {
+    pthread_mutex_lock(&p->audio_mutex);
+    p->seek_pending = secs;
+    pthread_mutex_unlock(&p->audio_mutex);
+}
+
+static void track_prefetch(int i) {
+    if (track_get_by_id(i) == NULL) return;
+    TrackFile* file = &p->tracks.files[p->tracks.order[i]];
+    if (file->file_data == NULL) return;
+
+    // Start asynchronous read-ahead so slow mounts are paged in before playback reaches the track
+    madvise(file->file_data, file->file_size, MADV_WILLNEED);
+}
+
 static void music_mute(float* prev_volume) {
     if (p->volume != 0.0f) *prev_volume = p->volume;
     p->volume = p->volume == 0.0f ? *prev_volume : 0.0f;
 }
 
 static bool music_is_playing() {
-    Track* track = track_get_cur();
-    if (track) return IsMusicStreamPlaying(track->music);
+    Music* music = track_get_cur();
+    if (music) return IsMusicStreamPlaying(*music);
     return false;
 }
 
 static void music_play_pause() {
-    Track* track = track_get_cur();
-    if (!track) return;
-    if (!p->music_is_paused && IsMusicStreamPlaying(track->music)) {
-        PauseMusicStream(track->music);
+    Music* music = track_get_cur();
+    if (!music) return;
+
+    pthread_mutex_lock(&p->audio_mutex);
+    if (!p->music_is_paused && IsMusicStreamPlaying(*music)) {
+        PauseMusicStream(*music);
         p->music_is_paused = true;
     } else {
-        PlayMusicStream(track->music);
-        ResumeMusicStream(track->music);
+        PlayMusicStream(*music);
+        ResumeMusicStream(*music);
         p->music_is_paused = false;
     }
+    pthread_mutex_unlock(&p->audio_mutex);
 }
 
 static void music_volume_up() {
@@ -755,29 +2797,116 @@ static void music_volume_down() {
     if (p->volume < 0.0f) p->volume = 0.0f;
 }
 
-/* Timeline UI renderer */
-static void timeline_render_loc(const char* file, int line, Rectangle boundary, Track* track) {
-    Vector2 mouse = GetMousePosition();
-    uint64_t id = djb2_id(file, line);
+/* Shuffle Order */
+static void shuffle_swap_pos(Shuffle* s, size_t a, size_t b) {
+    size_t track_a = s->order.items[a];
+    size_t track_b = s->order.items[b];
+    s->order.items[a] = track_b;
+    s->order.items[b] = track_a;
+    s->pos.items[track_b] = a;
+    s->pos.items[track_a] = b;
+}
 
-    float played = GetMusicTimePlayed(track->music);
-    float len = GetMusicTimeLength(track->music);
-    float progress = played / len * GetScreenWidth();
+static void shuffle_add(Shuffle* s) {
+    // New tracks join the undrawn pool, so they play before the cycle ends
+    size_t i = s->order.count;
+    da_append(&s->order, i);
+    da_append(&s->pos, i);
+}
 
-    Vector2 start_pos = {progress, boundary.y};
-    Vector2 end_pos = {progress, boundary.y + boundary.height};
+static void shuffle_remove(Shuffle* s, size_t slot, size_t last) {
+    size_t q = s->pos.items[slot];
+
+    if (q < s->drawn) {
+        // Keep the play history in order
+        memmove(s->order.items + q, s->order.items + q + 1, (s->order.count - q - 1) * sizeof(s->order.items[0]));
+        s->order.count--;
+        for (size_t k = q; k < s->order.count; ++k) s->pos.items[s->order.items[k]] = k;
+        if (q < s->cursor) s->cursor--;
+        s->drawn--;
+        if (s->cursor >= s->drawn) s->cursor = s->drawn > 0 ? s->drawn - 1 : 0;
+    } else {
+        s->order.items[q] = s->order.items[s->order.count - 1];
+        s->pos.items[s->order.items[q]] = q;
+        s->order.count--;
+    }
 
-    // Draw time elapsed and whole time of the track in each corner of the timeline
-    const char* time_elapsed = TextFormat("%02i:%02i", (int)played / 60, (int)played % 60);
-    const char* time_whole = TextFormat("%02i:%02i", (int)len / 60, (int)len % 60);
-    float font_size = boundary.height * 0.3f;
-    float text_pad = ceilf(boundary.width * 0.02f);
-    int text_w = MeasureText(time_whole, font_size);
-    float pos_y = boundary.y + boundary.height / 2 - font_size / 2;
+    // The last slot was moved into the removed one
+    if (slot != last) {
+        s->pos.items[slot] = s->pos.items[last];
+        s->order.items[s->pos.items[slot]] = slot;
+    }
+    s->pos.count--;
+}
+
+static int shuffle_next(Shuffle* s) {
+    size_t next = s->drawn == 0 ? 0 : s->cursor + 1;
+    if (next >= s->order.count) return -1;
+
+    // Lazy Fisher-Yates: draw the next track from the pool only when it is needed
+    if (next >= s->drawn) {
+        shuffle_swap_pos(s, next, GetRandomValue(next, s->order.count - 1));
+        s->drawn = next + 1;
+    }
+    return s->order.items[next];
+}
+
+static int shuffle_prev(Shuffle* s) {
+    if (s->drawn == 0 || s->cursor == 0) return -1;
+    return s->order.items[s->cursor - 1];
+}
+
+static void shuffle_jump(Shuffle* s, size_t i) {
+    size_t q = s->pos.items[i];
+    if (s->drawn > 0 && q <= s->cursor) {
+        s->cursor = q;
+        return;
+    }
+
+    size_t next = s->drawn == 0 ? 0 : s->cursor + 1;
+    shuffle_swap_pos(s, q, next);
+    s->cursor = next;
+    if (s->drawn < next + 1) s->drawn = next + 1;
+}
+
+static void shuffle_reshuffle(Shuffle* s) {
+    if (s->drawn > 0) s->drawn = s->cursor + 1;
+}
+
+static void shuffle_restart(Shuffle* s) {
+    if (s->drawn == 0) return;
+    shuffle_swap_pos(s, s->cursor, 0);
+    s->cursor = 0;
+    s->drawn = 1;
+}
+
+/* Timeline UI renderer */
+#undef MEM_TAG
+#define MEM_TAG MEM_UI
+static void timeline_render_loc(const char* file, int line, Rectangle boundary, Music* music) {
+    Vector2 mouse = GetMousePosition();
+    uint64_t id = djb2_id(file, line);
+
+    static float seek_target = -1.0f;
+    float played = p->seek_pending >= 0.0f ? p->seek_pending : GetMusicTimePlayed(*music);
+    float len = GetMusicTimeLength(*music);
+    float progress = played / len * GetScreenWidth();
+
+    Vector2 start_pos = {progress, boundary.y};
+    Vector2 end_pos = {progress, boundary.y + boundary.height};
+
+    // Draw time elapsed and whole time of the track in each corner of the timeline
+    const char* time_elapsed = arena_sprintf(&p->frame, "%02i:%02i", (int)played / 60, (int)played % 60);
+    const char* time_whole = arena_sprintf(&p->frame, "%02i:%02i", (int)len / 60, (int)len % 60);
+    float font_size = boundary.height * 0.3f;
+    float text_pad = ceilf(boundary.width * 0.02f);
+    int text_w = MeasureText(time_whole, font_size);
+    float pos_y = boundary.y + boundary.height / 2 - font_size / 2;
 
     BeginScissorMode(boundary.x, boundary.y, boundary.width, boundary.height + HUD_EDGE_WIDTH);
     {
         ClearBackground(COLOR_TIMELINE_BACKGROUND);
+        peaks_render(boundary, progress);
         DrawText(time_elapsed, boundary.x + text_pad, pos_y, font_size, WHITE);
         DrawText(time_whole, boundary.x + boundary.width - text_pad - text_w, pos_y, font_size, WHITE);
 
@@ -786,15 +2915,20 @@ static void timeline_render_loc(const char* file, int line, Rectangle boundary,
 
         UIState state = handle_btn(id, boundary);
         if (state == UIS_DRAG || state == UIS_CLICKED) {
-            float t = (mouse.x - boundary.x) / boundary.width;
-            SeekMusicStream(track->music, t * len);
+            float t = Clamp((mouse.x - boundary.x) / boundary.width, 0.0f, 1.0f);
+            if (t * len != seek_target) track_seek(t * len);
+            seek_target = t * len;
+        } else {
+            seek_target = -1.0f;
         }
     }
     EndScissorMode();
 }
 
 /* Popup Management */
-static void popups_push(Popups* ps, char* header, char* msg) {
+#undef MEM_TAG
+#define MEM_TAG MEM_POPUPS
+static void popups_push(Popups* ps, const char* header, const char* msg) {
     if (ps->count < POPUP_CAPACITY) {
         if (ps->begin == 0) {
             ps->begin = POPUP_CAPACITY - 1;
@@ -804,8 +2938,8 @@ static void popups_push(Popups* ps, char* header, char* msg) {
 
         ps->count += 1;
 
-        POPUP_FIRST(ps)->header = header;
-        POPUP_FIRST(ps)->msg = msg;
+        snprintf(POPUP_FIRST(ps)->header, POPUP_HEADER_CAPACITY, "%s", header);
+        snprintf(POPUP_FIRST(ps)->msg, POPUP_MSG_CAPACITY, "%s", msg);
         ps->slide += HUD_POPUP_SLIDEIN_SECS;
         POPUP_FIRST(ps)->lifetime = HUD_POPUP_LIFETIME_SECS + ps->slide;
     }
@@ -838,11 +2972,7 @@ static void popups_render(Popups* ps, Rectangle boundary, float dt) {
         DrawText(it->msg, popup.x + popup.width / 2 - width / 2, popup.y + HUD_POPUP_PAD / 2 + HUD_POPUP_FONT_SIZE, HUD_POPUP_FONT_SIZE, c);
     }
 
-    while (ps->count > 0 && POPUP_LAST(ps)->lifetime <= 0) {
-        free(POPUP_LAST(ps)->msg);
-        free(POPUP_LAST(ps)->header);
-        ps->count -= 1;
-    }
+    while (ps->count > 0 && POPUP_LAST(ps)->lifetime <= 0) ps->count -= 1;
 }
 
 /* Fullscreen Button UI renderer */
@@ -960,20 +3090,19 @@ static void track_render(Rectangle boundary, Rectangle item, Color c, size_t i)
 
     float font_size = TRACK_NAME_FONT_SIZE + item.height * 0.1f;
     float text_pad = item.width * 0.05f;
-    char* track_name = get_track_name(p->tracks.items[i].file_path);
+    char* track_name = get_track_name(track_get_path(i));
     str_fit_width(track_name, item.width - (icon_size + icon_margin * 2), font_size, text_pad);
     DrawText(track_name, item.x + text_pad, item.y + item.height / 2 - font_size / 2, font_size, BLACK);
-    free(track_name);
 }
 
 static bool track_handle_act_loc(const char* file, int line, Rectangle boundary, Rectangle* item, Color* c, size_t i) {
-    Track* track = track_get_by_id(i);
-    assert(track != NULL);
+    assert(track_get_by_id(i) != NULL);
 
     Vector2 mouse = GetMousePosition();
     bool defer_render = false;
     uint64_t id = djb2_id(file, line);
-    uint64_t item_id = djb2(id, &track->file_path, sizeof(i));
+    uint32_t slot = p->tracks.order[i];  // Slots are stable while the track is dragged around
+    uint64_t item_id = djb2(id, &slot, sizeof(slot));
 
     UIState state = handle_btn(item_id, GetCollisionRec(boundary, *item));
 
@@ -1021,12 +3150,14 @@ static void tracks_render(Rectangle boundary, float item_size, float scroll_w, f
 
         Color c;
         bool defer = track_handle_act(boundary, &item, &c, i);
-        if (!defer) {
-            track_render(boundary, item, c, i);
-        } else {
+        bool visible = item.y + item.height >= boundary.y && item.y <= boundary.y + boundary.height;
+        if (defer) {
+            // The dragged track is drawn last, on top of the others
             defer_c = c;
             defer_item = item;
             defer_i = i;
+        } else if (visible) {
+            track_render(boundary, item, c, i);
         }
     }
 
@@ -1075,140 +3206,1490 @@ static void handle_scroll(Rectangle boundary, bool* scroll, float* scroll_offset
     }
 }
 
-static void tracks_panel_render(Rectangle boundary, float dt) {
-    Vector2 mouse = GetMousePosition();
+static void tracks_panel_render(Rectangle boundary, float dt) {
+    Vector2 mouse = GetMousePosition();
+
+    static bool scroll = false;
+    static float scroll_offset = 0.0f;
+
+    size_t track_count = p->tracks.count;
+    float tracks_offset = (3 * HUD_ICON_MARGIN_BASE + 2 * HUD_ICON_SIZE_BASE) * boundary.height / BASE_HEIGHT;
+    float scroll_w = boundary.width * SCROLL_PERCENT - HUD_EDGE_WIDTH;
+    float item_size = boundary.width * TRACK_ITEM_PERCENT;
+    float scrollable_area = item_size * track_count;
+
+    static float panel_velocity = 0.0f;
+    if (CheckCollisionPointRec(mouse, boundary))
+        panel_velocity = panel_velocity * VELOCITY_DECAY + GetMouseWheelMove() * item_size * 8;
+
+    float max_scroll = scrollable_area - boundary.height + tracks_offset;
+    static float panel_scroll = 0.0f;
+    panel_scroll -= panel_velocity * dt;
+
+    if (scroll)
+        panel_scroll = (mouse.y - boundary.y - tracks_offset - scroll_offset) / (boundary.height + tracks_offset) * scrollable_area;
+    if (panel_scroll < 0) panel_scroll = 0;
+    if (max_scroll < 0) max_scroll = 0;
+    if (panel_scroll > max_scroll) panel_scroll = max_scroll;
+
+    BeginScissorMode(boundary.x, boundary.y, boundary.width, boundary.height);
+    {
+        ClearBackground(COLOR_TRACK_PANEL_BACKGROUND);
+
+        music_options_render(boundary, p->mode & MODE_REPEAT1 ? MODE_REPEAT1 : MODE_REPEAT, 0);  // Draw repeat
+        music_options_render(boundary, MODE_SHUFFLE, 1);                                         // Draw shuffle
+        music_control_render(boundary, TRACK_PREV, 0);                                           // Draw prev
+        music_control_render(boundary, music_is_playing() ? TRACK_PAUSE : TRACK_PLAY, 1);        // Draw pause
+        music_control_render(boundary, TRACK_NEXT, 2);                                           // Draw next
+
+        Rectangle tracks_boundary = {boundary.x, boundary.y + tracks_offset, boundary.width, boundary.height - tracks_offset};
+        BeginScissorMode(tracks_boundary.x, tracks_boundary.y, tracks_boundary.width, tracks_boundary.height);
+        {
+            handle_scroll(tracks_boundary, &scroll, &scroll_offset, &panel_velocity, scrollable_area, scroll_w, panel_scroll, item_size);
+            tracks_render(tracks_boundary, item_size, scroll_w, panel_scroll);
+        }
+        EndScissorMode();
+
+        Vector2 edge_start_pos = {boundary.x, boundary.y + tracks_offset};
+        Vector2 edge_end_pos = {boundary.x + boundary.width, edge_start_pos.y};
+        DrawLineEx(edge_start_pos, edge_end_pos, HUD_EDGE_WIDTH, COLOR_TRACK_BUTTON_BACKGROUND);
+    }
+    EndScissorMode();
+
+    Vector2 edge_start_pos = {boundary.x + boundary.width, boundary.y};
+    Vector2 edge_end_pos = {edge_start_pos.x, boundary.y + boundary.height};
+    DrawLineEx(edge_start_pos, edge_end_pos, HUD_EDGE_WIDTH, COLOR_TRACK_BUTTON_BACKGROUND);
+}
+
+/* Music Control UI renderer */
+static void music_options_loc(const char* file, int line, Rectangle boundary, PlayMode icon, int icon_pos) {
+    uint64_t id = djb2_id(file, line);
+
+    int icon_cnt = 2;
+    int total_icon_cnt = 3;
+    int icon_id = icon > MODE_REPEAT1 ? icon - MODE_REPEAT1 : icon - MODE_REPEAT;  // Get to 0, 1, 2
+
+    float icon_margin = HUD_ICON_MARGIN_BASE * boundary.height / BASE_HEIGHT;
+    float icon_size = HUD_ICON_SIZE_BASE * boundary.height / BASE_HEIGHT;
+
+    float gap_size = (boundary.width - HUD_EDGE_WIDTH - icon_cnt * icon_size) / (icon_cnt + 1);
+    float btn_x = boundary.x + icon_pos * icon_size + (icon_pos + 1) * gap_size;
+
+    Color c = COLOR_HUD_BTN_BACKGROUND;
+    Rectangle btn = {btn_x, boundary.y + icon_margin, icon_size, icon_size};
+
+    if (p->mode & icon) {
+        c = COLOR_HUD_BTN_HOVEROVER;
+        Rectangle rec = {btn.x - icon_margin / 2, btn.y - icon_margin / 2, btn.width + icon_margin, btn.height + icon_margin};
+        DrawRectangleRounded(rec, 0.3, 20, COLOR_TRACK_BUTTON_SELECTED);
+    }
+
+    UIState state = handle_btn(id, btn);
+    if (state == UIS_HOVER) c = COLOR_HUD_BTN_HOVEROVER;
+    if (state == UIS_CLICKED) {
+        if (p->mode & MODE_REPEAT && icon == MODE_REPEAT) {
+            p->mode = (p->mode & ~MODE_REPEAT) | MODE_REPEAT1;
+        } else if (p->mode & MODE_REPEAT1 && icon == MODE_REPEAT) {
+            p->mode = p->mode & ~MODE_REPEAT1;
+        } else {
+            if (p->mode & icon) {
+                p->mode = p->mode & ~icon;
+            } else {
+                p->mode = p->mode | icon;
+            }
+        }
+        if (icon == MODE_SHUFFLE && p->mode & MODE_SHUFFLE) shuffle_reshuffle(&p->shuffle);
+    }
+
+    draw_icon(MUSIC_OPTIONS_IMAGE_FILEPATH, icon_id, total_icon_cnt, btn, c);
+}
+
+static void music_control_loc(const char* file, int line, Rectangle boundary, MusicControl icon, int icon_pos) {
+    uint64_t id = djb2_id(file, line);
+
+    int icon_cnt = 3;
+    int total_icon_cnt = 4;
+    int icon_id = icon;
+
+    float icon_margin = HUD_ICON_MARGIN_BASE * boundary.height / BASE_HEIGHT;
+    float icon_size = HUD_ICON_SIZE_BASE * boundary.height / BASE_HEIGHT;
+
+    float gap_size = (boundary.width - HUD_EDGE_WIDTH - icon_cnt * icon_size) / (icon_cnt + 1);
+    float btn_x = boundary.x + icon_pos * icon_size + (icon_pos + 1) * gap_size;
+
+    Color c = COLOR_HUD_BTN_BACKGROUND;
+    Rectangle btn = {btn_x, boundary.y + 2 * icon_margin + icon_size, icon_size, icon_size};
+
+    UIState state = handle_btn(id, btn);
+    if (state == UIS_HOVER) c = COLOR_HUD_BTN_HOVEROVER;
+    if (state == UIS_CLICKED) {
+        switch (icon) {
+            case TRACK_PREV:
+                track_prev_handle();
+                break;
+            case TRACK_PLAY:
+            case TRACK_PAUSE:
+                music_play_pause();
+                break;
+            case TRACK_NEXT:
+                track_next_handle(true);
+                break;
+        }
+    }
+
+    draw_icon(MUSIC_CONTROLS_IMAGE_FILEPATH, icon_id, total_icon_cnt, btn, c);
+}
+
+/* Profiler */
+#undef MEM_TAG
+#define MEM_TAG MEM_DEBUG
+static void prof_begin(ProfStage stage) {
+    trace_begin(prof_stage_threads[stage], prof_stage_names[stage]);
+    if (!p->prof.enabled) return;
+    p->prof.rings[stage].start = time_now();
+    p->prof.rings[stage].start_epoch = atomic_load(&p->prof.epoch);
+}
+
+static void prof_end(ProfStage stage) {
+    trace_end(prof_stage_threads[stage], prof_stage_names[stage]);
+    if (!p->prof.enabled) return;
+
+    // The stage began before profiling was enabled, or before it was last turned off and on again
+    ProfRing* ring = &p->prof.rings[stage];
+    if (ring->start == 0.0 || ring->start_epoch != atomic_load(&p->prof.epoch)) return;
+    ring->items[ring->count % PROF_RING_CAPACITY] = (time_now() - ring->start) * 1000.0;
+    ring->count += 1;
+    ring->start = 0.0;
+}
+
+static void prof_percentiles(const ProfRing* ring, float out[3]) {
+    float sorted[PROF_RING_CAPACITY];
+    size_t n = ring->count < PROF_RING_CAPACITY ? ring->count : PROF_RING_CAPACITY;
+    if (n == 0) {
+        out[0] = out[1] = out[2] = 0.0f;
+        return;
+    }
+
+    memcpy(sorted, ring->items, n * sizeof(sorted[0]));
+    qsort(sorted, n, sizeof(sorted[0]), float_cmp);
+    out[0] = sorted[(n - 1) * 50 / 100];
+    out[1] = sorted[(n - 1) * 95 / 100];
+    out[2] = sorted[(n - 1) * 99 / 100];
+}
+
+static void prof_render(Rectangle boundary) {
+    float line_h = PROF_FONT_SIZE + 2;
+    float col_w = MeasureText("00.000", PROF_FONT_SIZE) + PROF_PAD;
+    float name_w = MeasureText(prof_stage_names[PROF_TRACKS_PANEL_RENDER], PROF_FONT_SIZE) + PROF_PAD;
+
+    float audio_w = MeasureText("callback over budget: 000000  late refills: 000000", PROF_FONT_SIZE);
+    Rectangle panel = {
+        .width = fmaxf(name_w + 3 * col_w, audio_w) + PROF_PAD,
+        .height = (COUNT_PROF_STAGES + 4) * line_h + 2 * PROF_PAD,
+    };
+    panel.x = boundary.x + PROF_PAD;
+    panel.y = boundary.y + boundary.height - panel.height - PROF_PAD;
+    DrawRectangleRounded(panel, 0.05, 20, COLOR_PROF_BACKGROUND);
+
+    float x = panel.x + PROF_PAD;
+    float y = panel.y + PROF_PAD;
+    DrawText("ms", x, y, PROF_FONT_SIZE, GRAY);
+    DrawText("p50", x + name_w, y, PROF_FONT_SIZE, GRAY);
+    DrawText("p95", x + name_w + col_w, y, PROF_FONT_SIZE, GRAY);
+    DrawText("p99", x + name_w + 2 * col_w, y, PROF_FONT_SIZE, GRAY);
+
+    for (ProfStage stage = 0; stage < COUNT_PROF_STAGES; ++stage) {
+        float ps[3];
+        prof_percentiles(&p->prof.rings[stage], ps);
+
+        y += line_h;
+        DrawText(prof_stage_names[stage], x, y, PROF_FONT_SIZE, WHITE);
+        for (int i = 0; i < 3; ++i) {
+            DrawText(arena_sprintf(&p->frame, "%.3f", ps[i]), x + name_w + i * col_w, y, PROF_FONT_SIZE, WHITE);
+        }
+    }
+
+    AudioStats* stats = &p->audio->stats;
+    uint64_t calls = atomic_load_explicit(&stats->calls, memory_order_relaxed);
+    uint64_t mean = calls > 0 ? atomic_load_explicit(&stats->total_ns, memory_order_relaxed) / calls : 0;
+    uint64_t max = atomic_load_explicit(&stats->max_ns, memory_order_relaxed);
+    uint64_t over = atomic_load_explicit(&stats->over_budget, memory_order_relaxed);
+    uint64_t late_refills = atomic_load_explicit(&stats->late_refills, memory_order_relaxed);
+
+    Color c = over + late_refills > 0 ? RED : WHITE;
+    y += line_h;
+    DrawText(arena_sprintf(&p->frame, "callback mean: %.3f  max: %.3f", mean / 1e6, max / 1e6), x, y, PROF_FONT_SIZE, WHITE);
+    y += line_h;
+    DrawText(arena_sprintf(&p->frame, "callback over budget: %lu  late refills: %lu", (unsigned long)over, (unsigned long)late_refills), x, y, PROF_FONT_SIZE, c);
+
+    uint64_t live = 0;
+    for (MemTag tag = 0; tag < COUNT_MEM_TAGS; ++tag) live += atomic_load_explicit(&p->mem.live[tag], memory_order_relaxed);
+    y += line_h;
+    DrawText(arena_sprintf(&p->frame, "allocs/frame: %lu  live: %lu KiB", (unsigned long)p->mem.frame_allocs, (unsigned long)(live / 1024)), x, y, PROF_FONT_SIZE, p->mem.frame_allocs > 0 ? RED : WHITE);
+}
+
+static void prof_dump(const char* file_path) {
+    FILE* f = fopen(file_path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: Could not open %s for writing\n", file_path);
+        popups_push(&p->popups, "Could not save the profile", GetFileName(file_path));
+        return;
+    }
+
+    fprintf(f, "stage,sample,ms\n");
+    for (ProfStage stage = 0; stage < COUNT_PROF_STAGES; ++stage) {
+        ProfRing* ring = &p->prof.rings[stage];
+        size_t n = ring->count < PROF_RING_CAPACITY ? ring->count : PROF_RING_CAPACITY;
+        for (size_t i = ring->count - n; i < ring->count; ++i) {
+            fprintf(f, "%s,%zu,%f\n", prof_stage_names[stage], i, ring->items[i % PROF_RING_CAPACITY]);
+        }
+    }
+    fclose(f);
+
+    printf("INFO: Profile saved to %s\n", file_path);
+    popups_push(&p->popups, "Profile saved", GetFileName(file_path));
+}
+
+/* Tracing */
+static void trace_event(TraceThread th, const char* name, char phase, float value) {
+    if (!atomic_load_explicit(&p->trace.enabled, memory_order_acquire)) return;
+
+    TraceBuffer* buf = &p->trace.bufs[th];
+    size_t count = atomic_load_explicit(&buf->count, memory_order_relaxed);
+    TraceEvent* e = &buf->items[count % TRACE_CAPACITY];
+    e->name = name;
+    e->ts_ns = time_now_ns();
+    e->value = value;
+    e->phase = phase;
+    atomic_store_explicit(&buf->count, count + 1, memory_order_release);
+}
+
+static void trace_begin(TraceThread th, const char* name) {
+    trace_event(th, name, 'B', 0.0f);
+}
+
+static void trace_end(TraceThread th, const char* name) {
+    trace_event(th, name, 'E', 0.0f);
+}
+
+static void trace_counter(TraceThread th, const char* name, float value) {
+    trace_event(th, name, 'C', value);
+}
+
+static void trace_start(void) {
+    for (TraceThread th = 0; th < COUNT_TRACE_THREADS; ++th) {
+        TraceBuffer* buf = &p->trace.bufs[th];
+        if (buf->items == NULL) da_malloc(buf->items, TRACE_CAPACITY);
+        buf->base = atomic_load(&buf->count);
+    }
+    p->trace.start_ns = time_now_ns();
+    atomic_store(&p->trace.enabled, true);
+    printf("INFO: Tracing started\n");
+}
+
+static void trace_stop(const char* file_path) {
+    atomic_store(&p->trace.enabled, false);
+
+    FILE* f = fopen(file_path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: Could not open %s for writing\n", file_path);
+        popups_push(&p->popups, "Could not save the trace", GetFileName(file_path));
+        return;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (TraceThread th = 0; th < COUNT_TRACE_THREADS; ++th) {
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                th == 0 ? "" : ",\n", th, trace_thread_names[th]);
+    }
+
+    for (TraceThread th = 0; th < COUNT_TRACE_THREADS; ++th) {
+        TraceBuffer* buf = &p->trace.bufs[th];
+        size_t count = atomic_load_explicit(&buf->count, memory_order_acquire);
+
+        // The oldest slot may still be overwritten by an event that was in flight when tracing stopped
+        size_t first = count > TRACE_CAPACITY - 1 ? count - (TRACE_CAPACITY - 1) : 0;
+        if (first < buf->base) first = buf->base;
+
+        for (size_t i = first; i < count; ++i) {
+            TraceEvent* e = &buf->items[i % TRACE_CAPACITY];
+            if (e->ts_ns < p->trace.start_ns) continue;
+
+            double ts = (e->ts_ns - p->trace.start_ns) / 1000.0;
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d", e->name, e->phase, ts, th);
+            if (e->phase == 'C') fprintf(f, ",\"args\":{\"value\":%g}", e->value);
+            fprintf(f, "}");
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+
+    printf("INFO: Trace saved to %s\n", file_path);
+    popups_push(&p->popups, "Trace saved", GetFileName(file_path));
+}
+
+/* Record and Replay */
+static void rec_start(const char* file_path) {
+    Recorder* r = &p->rec;
+    if (r->samples == NULL) da_malloc(r->samples, REC_RING_FRAMES);
+    if (r->sizes == NULL) da_malloc(r->sizes, REC_RING_BUFFERS);
+
+    r->file = fopen(file_path, "wb");
+    if (r->file == NULL) {
+        fprintf(stderr, "ERROR: Could not open %s for writing\n", file_path);
+        popups_push(&p->popups, "Could not start recording", GetFileName(file_path));
+        return;
+    }
+
+    RecHeader header = {
+        .version = REC_VERSION,
+        .fft_size = FFT_SIZE,
+        .sample_rate = atomic_load(&p->audio->rate),
+        .width = GetScreenWidth(),
+        .height = GetScreenHeight(),
+        .track_count = p->tracks.count,
+        .cur_track = p->cur_track,
+        .engine = atomic_load(&p->audio->engine),
+        .mode = p->mode,
+        .volume = p->volume,
+        .paused = p->music_is_paused,
+        .fullscreen = p->fullscreen,
+    };
+    memcpy(header.magic, REC_MAGIC, sizeof(header.magic));
+    fwrite(&header, sizeof(header), 1, r->file);
+    for (size_t id = 0; id < p->tracks.count; ++id) {
+        const char* path = track_get_path(id);
+        uint32_t length = strlen(path);
+        fputc(REC_TRACK, r->file);
+        fwrite(&length, sizeof(length), 1, r->file);
+        fwrite(path, 1, length, r->file);
+    }
+
+    // Whatever is still in the rings belongs to an earlier recording
+    atomic_store(&r->samples_tail, atomic_load(&r->samples_head));
+    atomic_store(&r->sizes_tail, atomic_load(&r->sizes_head));
+    atomic_store(&r->dropped, 0);
+    r->frame = 1;  // raylib counts the frame rec_start() runs in as 0, its input started the recording
+
+    if (r->events.events == NULL) {
+        da_malloc(r->events.events, REC_MAX_EVENTS);
+        r->events.capacity = REC_MAX_EVENTS;
+    }
+    r->events.count = 0;
+    SetAutomationEventList(&r->events);
+    SetAutomationEventBaseFrame(0);
+    StartAutomationEventRecording();
+
+    atomic_store(&r->active, true);
+    printf("INFO: Recording to %s\n", file_path);
+    popups_push(&p->popups, "Recording", GetFileName(file_path));
+}
+
+static void rec_stop(void) {
+    Recorder* r = &p->rec;
+    atomic_store(&r->active, false);
+    StopAutomationEventRecording();
+
+    fputc(REC_END, r->file);
+    fclose(r->file);
+    r->file = NULL;
+
+    printf("INFO: Recorded %lu frames, %u audio buffers dropped\n", (unsigned long)r->frame - 1,
+           atomic_load(&r->dropped));
+    popups_push(&p->popups, "Recording saved", GetFileName(REC_FILEPATH));
+}
+
+// Runs on the audio thread, so it only copies into the rings and never blocks
+static void rec_capture(float (*fs)[2], unsigned int frames) {
+    Recorder* r = &p->rec;
+    size_t samples_head = atomic_load_explicit(&r->samples_head, memory_order_relaxed);
+    size_t samples_tail = atomic_load_explicit(&r->samples_tail, memory_order_acquire);
+    size_t sizes_head = atomic_load_explicit(&r->sizes_head, memory_order_relaxed);
+    size_t sizes_tail = atomic_load_explicit(&r->sizes_tail, memory_order_acquire);
+
+    if (samples_head - samples_tail + frames > REC_RING_FRAMES || sizes_head - sizes_tail >= REC_RING_BUFFERS) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    size_t at = samples_head % REC_RING_FRAMES;
+    size_t first = frames < REC_RING_FRAMES - at ? frames : REC_RING_FRAMES - at;
+    memcpy(r->samples + at, fs, first * sizeof(fs[0]));
+    memcpy(r->samples, fs + first, (frames - first) * sizeof(fs[0]));
+    r->sizes[sizes_head % REC_RING_BUFFERS] = frames;
+
+    atomic_store_explicit(&r->samples_head, samples_head + frames, memory_order_release);
+    atomic_store_explicit(&r->sizes_head, sizes_head + 1, memory_order_release);
+}
+
+// Runs after EndDrawing(), which records the input this frame read
+static void rec_frame(float dt) {
+    Recorder* r = &p->rec;
+    size_t sizes_head = atomic_load_explicit(&r->sizes_head, memory_order_acquire);
+    size_t sizes_tail = atomic_load_explicit(&r->sizes_tail, memory_order_relaxed);
+    size_t samples_tail = atomic_load_explicit(&r->samples_tail, memory_order_relaxed);
+
+    for (; sizes_tail < sizes_head; ++sizes_tail) {
+        uint32_t frames = r->sizes[sizes_tail % REC_RING_BUFFERS];
+        size_t at = samples_tail % REC_RING_FRAMES;
+        size_t first = frames < REC_RING_FRAMES - at ? frames : REC_RING_FRAMES - at;
+
+        fputc(REC_AUDIO, r->file);
+        fwrite(&frames, sizeof(frames), 1, r->file);
+        fwrite(r->samples + at, sizeof(r->samples[0]), first, r->file);
+        fwrite(r->samples, sizeof(r->samples[0]), frames - first, r->file);
+        samples_tail += frames;
+    }
+    atomic_store_explicit(&r->samples_tail, samples_tail, memory_order_release);
+    atomic_store_explicit(&r->sizes_tail, sizes_tail, memory_order_release);
+
+    // Before the first frame the list still holds the input of the one rec_start() ran in
+    uint32_t count = 0;
+    for (unsigned int i = 0; i < r->events.count; ++i) {
+        if (r->events.events[i].frame >= r->frame) r->events.events[count++] = r->events.events[i];
+    }
+    fputc(REC_INPUT, r->file);
+    fwrite(&count, sizeof(count), 1, r->file);
+    fwrite(r->events.events, sizeof(r->events.events[0]), count, r->file);
+    r->events.count = 0;  // raylib appends at count, so the list only ever holds one frame
+
+    RecFrame frame = {.frame = r->frame++, .time = GetTime(), .dt = dt, .dropped = atomic_load(&r->dropped)};
+    fputc(REC_FRAME, r->file);
+    fwrite(&frame, sizeof(frame), 1, r->file);
+}
+
+/* Latency Measurement */
+static bool latency_click_train_export(const char* file_path) {
+    unsigned int frame_count = LATENCY_CLICK_TRAIN_SECS * LATENCY_CLICK_RATE;
+    unsigned int period = LATENCY_CLICK_PERIOD_SECS * LATENCY_CLICK_RATE;
+    unsigned int click_len = LATENCY_CLICK_SECS * LATENCY_CLICK_RATE;
+
+    short* samples;
+    da_malloc(samples, (size_t)frame_count * 2);
+
+    // Alternating full-scale samples put the energy of every click into all bins at once
+    for (unsigned int start = 0; start < frame_count; start += period) {
+        for (unsigned int i = 0; i < click_len && start + i < frame_count; ++i) {
+            short v = i % 2 ? -28000 : 28000;
+            samples[2 * (start + i) + 0] = v;
+            samples[2 * (start + i) + 1] = v;
+        }
+    }
+
+    Wave wave = {
+        .frameCount = frame_count,
+        .sampleRate = LATENCY_CLICK_RATE,
+        .sampleSize = 16,
+        .channels = 2,
+        .data = samples,
+    };
+    bool ok = ExportWave(wave, file_path);
+    FREE(samples);
+    return ok;
+}
+
+static void latency_toggle(void) {
+    if (p->latency.enabled) {
+        p->latency.enabled = false;
+        return;
+    }
+    p->latency = (Latency){.enabled = true};
+
+    if (!track_exists(LATENCY_CLICK_FILEPATH)) {
+        if (!latency_click_train_export(LATENCY_CLICK_FILEPATH)) {
+            fprintf(stderr, "ERROR: Could not write the click train to %s\n", LATENCY_CLICK_FILEPATH);
+            popups_push(&p->popups, "Could not create", GetFileName(LATENCY_CLICK_FILEPATH));
+            return;
+        }
+        track_add(LATENCY_CLICK_FILEPATH);
+        if (track_exists(LATENCY_CLICK_FILEPATH)) track_play(p->tracks.count - 1);
+    }
+}
+
+static void latency_update(Music* music) {
+    // In device frames, like the position stamp of the spectrum
+    float rate = atomic_load(&p->audio->rate);
+    double played = GetMusicTimePlayed(*music) * rate;
+
+    // Spectrum on screen vs. what the device has consumed, the position stamp travels with the spectrum
+    Latency* l = &p->latency;
+    l->lag.items[l->lag.count % PROF_RING_CAPACITY] = (played - (double)p->render->pos) / rate * 1000.0;
+    l->lag.count += 1;
+
+    // With the click train every onset is at a known position, so the rising edge of the bars gives the perceived lag
+    if (p->cur_track < 0 || strcmp(track_get_path(p->cur_track), LATENCY_CLICK_FILEPATH) != 0) return;
+    if (p->render->count == 0) return;
+
+    float energy = 0.0f;
+    for (size_t i = 0; i < p->render->count; ++i) energy += p->render->smoothed[i];
+    energy /= p->render->count;
+
+    if (!l->click_high && energy > LATENCY_CLICK_THRESHOLD) {
+        double period = LATENCY_CLICK_PERIOD_SECS * rate;
+        double click = floor(played / period) * period;
+        l->click_lag.items[l->click_lag.count % PROF_RING_CAPACITY] = (played - click) / rate * 1000.0;
+        l->click_lag.count += 1;
+        l->click_high = true;
+    } else if (l->click_high && energy < LATENCY_CLICK_THRESHOLD * 0.5f) {
+        l->click_high = false;
+    }
+}
+
+static void latency_render(Rectangle boundary) {
+    float line_h = PROF_FONT_SIZE + 2;
+    float col_w = MeasureText("0000.0", PROF_FONT_SIZE) + PROF_PAD;
+    float name_w = MeasureText("spectrum lag", PROF_FONT_SIZE) + PROF_PAD;
+
+    Rectangle panel = {
+        .width = name_w + 3 * col_w + PROF_PAD,
+        .height = 5 * line_h + 2 * PROF_PAD,
+    };
+    panel.x = boundary.x + boundary.width - panel.width - PROF_PAD;
+    panel.y = boundary.y + boundary.height - panel.height - PROF_PAD;
+    DrawRectangleRounded(panel, 0.05, 20, COLOR_PROF_BACKGROUND);
+
+    float x = panel.x + PROF_PAD;
+    float y = panel.y + PROF_PAD;
+    DrawText("ms", x, y, PROF_FONT_SIZE, GRAY);
+    DrawText("p50", x + name_w, y, PROF_FONT_SIZE, GRAY);
+    DrawText("p95", x + name_w + col_w, y, PROF_FONT_SIZE, GRAY);
+    DrawText("p99", x + name_w + 2 * col_w, y, PROF_FONT_SIZE, GRAY);
+
+    const char* names[] = {"spectrum lag", "click lag"};
+    const ProfRing* rings[] = {&p->latency.lag, &p->latency.click_lag};
+    for (size_t r = 0; r < 2; ++r) {
+        float ps[3];
+        prof_percentiles(rings[r], ps);
+
+        y += line_h;
+        DrawText(names[r], x, y, PROF_FONT_SIZE, WHITE);
+        for (int i = 0; i < 3; ++i) {
+            DrawText(arena_sprintf(&p->frame, "%.1f", ps[i]), x + name_w + i * col_w, y, PROF_FONT_SIZE, WHITE);
+        }
+    }
+
+    // The parts the stamp cannot see: half the window is already in the stamp, the frame is yet to be presented
+    y += line_h;
+    DrawText(arena_sprintf(&p->frame, "window/2: %.1f", FFT_SIZE / 2 * 1000.0 / ANALYSIS_RATE), x, y, PROF_FONT_SIZE, WHITE);
+    y += line_h;
+    DrawText(arena_sprintf(&p->frame, "frame: %.1f", GetFrameTime() * 1000.0), x, y, PROF_FONT_SIZE, WHITE);
+}
+
+/* Spectrum Cache */
+#undef MEM_TAG
+#define MEM_TAG MEM_FFT
+// $XDG_CACHE_HOME/musicvis/<key>.<ext> or ~/.cache/musicvis/<key>.<ext>, the directories are created on the way
+static bool cache_path(char* out, size_t size, uint64_t key, const char* ext) {
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+
+    int n;
+    if (xdg != NULL && xdg[0] != '\0') {
+        n = snprintf(out, size, "%s", xdg);
+    } else if (home != NULL) {
+        n = snprintf(out, size, "%s/.cache", home);
+    } else {
+        return false;
+    }
+    if (n < 0 || (size_t)n >= size) return false;
+    mkdir(out, 0755);
+
+    size_t len = n;
+    n = snprintf(out + len, size - len, "/%s", CACHE_DIR_NAME);
+    if (n < 0 || (size_t)n >= size - len) return false;
+    if (mkdir(out, 0755) != 0 && errno != EEXIST) return false;
+
+    len += n;
+    n = snprintf(out + len, size - len, "/%016lx.%s", (unsigned long)key, ext);
+    return n > 0 && (size_t)n < size - len;
+}
+
+// Changes with the file and with the settings the cached data depends on, 0 if the file is gone
+static uint64_t cache_key(const char* file_path, const void* config, size_t config_size) {
+    struct stat st;
+    if (stat(file_path, &st) != 0) return 0;
+
+    uint64_t file[] = {st.st_mtim.tv_sec, st.st_mtim.tv_nsec, st.st_size};
+    uint64_t key = djb2(DJB2_INIT, file_path, strlen(file_path));
+    key = djb2(key, file, sizeof(file));
+    return djb2(key, config, config_size);
+}
+
+static uint64_t spec_key(const char* file_path) {
+    struct {
+        uint32_t version, fft_size, hop;
+        float freq_step, low_freq;
+    } config = {SPEC_VERSION, FFT_SIZE, SPEC_HOP, FREQ_STEP, LOW_FREQ};
+    return cache_key(file_path, &config, sizeof(config));
+}
+
+static bool spec_map(const char* cache, uint64_t key) {
+    size_t size = 0;
+    unsigned char* data = file_map(cache, &size);
+    if (data == NULL) return false;
+
+    const SpecHeader* h = (const SpecHeader*)data;
+    bool valid = size >= sizeof(*h) && memcmp(h->magic, SPEC_MAGIC, sizeof(h->magic)) == 0 && h->version == SPEC_VERSION &&
+                 h->key == key && h->band_count == p->analysis->freq_count && h->frame_count > 0 &&
+                 h->sample_rate > 0 && size >= sizeof(*h) + (size_t)h->frame_count * h->band_count;
+    if (!valid) {
+        fprintf(stderr, "ERROR: Ignoring the invalid spectrum cache %s\n", cache);
+        munmap(data, size);
+        return false;
+    }
+
+    spec_unmap();
+    pthread_mutex_lock(&p->analysis->th_mutex);
+    p->spec.data = data;
+    p->spec.size = size;
+    pthread_mutex_unlock(&p->analysis->th_mutex);
+    return true;
+}
+
+static void spec_unmap(void) {
+    pthread_mutex_lock(&p->analysis->th_mutex);
+    if (p->spec.data != NULL) munmap(p->spec.data, p->spec.size);
+    p->spec.data = NULL;
+    p->spec.size = 0;
+    pthread_mutex_unlock(&p->analysis->th_mutex);
+}
+
+// Maps the cache of the track that starts playing, or starts analyzing it when there is none yet
+static void spec_open(const char* file_path) {
+    spec_unmap();
+    if (p->spec.disabled) return;
+
+    char cache[PATH_MAX];
+    uint64_t key = spec_key(file_path);
+    if (key == 0 || !cache_path(cache, sizeof(cache), key, SPEC_CACHE_EXT)) return;
+    if (spec_map(cache, key)) return;
+    if (!p->spec.job_running) spec_job_start(file_path, cache, key);
+}
+
+// Publishes the cached spectrum at the playback position, false when the current track has no cache
+static bool spec_lookup(float dt) {
+    pthread_mutex_lock(&p->analysis->th_mutex);
+    const SpecHeader* h = (const SpecHeader*)p->spec.data;
+    if (h == NULL) {
+        pthread_mutex_unlock(&p->analysis->th_mutex);
+        return false;
+    }
+
+    // in_pos counts device frames whatever the track's rate, the cache counts samples at ANALYSIS_RATE
+    unsigned int rate = atomic_load(&p->audio->rate);
+    uint64_t out_pos = fft_center_pos(atomic_load(&p->audio->in_pos), rate);
+
+    // Blend the two frames around the position
+    double f = (double)out_pos * h->sample_rate / (rate > 0 ? rate : h->sample_rate) / h->hop;
+    size_t i0 = f < h->frame_count - 1 ? (size_t)f : h->frame_count - 1;
+    size_t i1 = i0 + 1 < h->frame_count ? i0 + 1 : i0;
+    float t = f < h->frame_count - 1 ? (float)(f - i0) : 0.0f;
+
+    const unsigned char* a = p->spec.data + sizeof(*h) + i0 * h->band_count;
+    const unsigned char* b = p->spec.data + sizeof(*h) + i1 * h->band_count;
+    for (size_t i = 0; i < h->band_count; ++i) {
+        p->analysis->out_logscaled[i] = (a[i] + (b[i] - a[i]) * t) / 255.0f;
+    }
+    p->analysis->freq_count = h->band_count;
+    fft_smooth(dt);
+    p->analysis->out_pos = out_pos;
+    pthread_mutex_unlock(&p->analysis->th_mutex);
+    return true;
+}
+
+// Sample i of the interleaved data, scaled like LoadWaveSamples() but read in the decoded format instead of copied
+static float wave_sample(const Wave* wave, size_t i) {
+    switch (wave->sampleSize) {
+    case 8: return (((const unsigned char*)wave->data)[i] - 128) / 128.0f;
+    case 16: return ((const short*)wave->data)[i] / 32768.0f;
+    default: return ((const float*)wave->data)[i];
+    }
+}
+
+// Decodes the file and writes its cache, the file only appears under its final name once complete.
+// The left channel goes through the analysis resampler a chunk at a time, so the decoded track is the only copy
+static void* spec_job_thread(void* arg) {
+    (void)arg;
+    sched_apply(SCHED_ROLE_BACKGROUND);
+    SpecCache* s = &p->spec;
+    uint64_t start = time_now_ns();
+
+    Wave wave = LoadWave(s->job_path);
+    if (!IsWaveReady(wave)) {
+        atomic_store(&s->job_done, true);
+        return NULL;
+    }
+    Resampler* r = s->job_resampler;
+    resampler_init(r, wave.sampleRate);  // Same bands as the live analysis
+    SpecHeader header = {
+        .magic = SPEC_MAGIC,
+        .version = SPEC_VERSION,
+        .key = s->job_key,
+        .sample_rate = ANALYSIS_RATE,
+        .hop = SPEC_HOP,
+        .band_count = p->analysis->freq_count,
+        .frame_count = (uint64_t)wave.frameCount * ANALYSIS_RATE / wave.sampleRate / SPEC_HOP + 1,
+    };
+
+    char tmp[PATH_MAX + 4];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", s->job_cache);
+    FILE* f = fopen(tmp, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: Could not create %s\n", tmp);
+        UnloadWave(wave);
+        atomic_store(&s->job_done, true);
+        return NULL;
+    }
+
+    float* in = s->job_scratch;
+    float* windowed = in + FFT_SIZE;
+    float complex* out = (float complex*)(windowed + FFT_SIZE);
+    float* bands = (float*)(out + FFT_SIZE);
+    unsigned char* frame = (unsigned char*)(bands + FFT_SIZE);
+
+    fwrite(&header, sizeof(header), 1, f);
+    // Frame i is centered on sample i * SPEC_HOP, so the window starts with half of it silent and slides
+    // by a hop every time it fills up. Past the end of the track the resampler is fed silence
+    memset(in, 0, FFT_SIZE / 2 * sizeof(in[0]));
+    size_t filled = FFT_SIZE / 2;
+    size_t chunk = resampler_chunk(r);
+    uint64_t written = 0;
+    for (uint64_t pos = 0; written < header.frame_count && !atomic_load(&s->job_stop); pos += chunk) {
+        float* x = r->x + RESAMPLE_TAPS - 1;
+        for (size_t j = 0; j < chunk; ++j) {
+            x[j] = pos + j < wave.frameCount ? wave_sample(&wave, (pos + j) * wave.channels) : 0.0f;
+        }
+        const float* y = x;
+        size_t count = chunk;
+        if (r->up != r->down) {
+            count = resampler_run(r, chunk);
+            y = r->y;
+        }
+
+        for (size_t j = 0; j < count && written < header.frame_count; ++j) {
+            in[filled++] = y[j];
+            if (filled < FFT_SIZE) continue;
+
+            fft_analyze(in, windowed, out, bands);
+            for (size_t b = 0; b < header.band_count; ++b) frame[b] = (unsigned char)(bands[b] * 255.0f + 0.5f);
+            fwrite(frame, 1, header.band_count, f);
+            written += 1;
+
+            memmove(in, in + SPEC_HOP, (FFT_SIZE - SPEC_HOP) * sizeof(in[0]));
+            filled -= SPEC_HOP;
+        }
+    }
+    UnloadWave(wave);
+
+    bool ok = !atomic_load(&s->job_stop) && !ferror(f);
+    ok = fclose(f) == 0 && ok;
+    ok = ok && rename(tmp, s->job_cache) == 0;
+    if (ok) {
+        printf("INFO: Spectrum cache of %s ready in %.3f s\n", s->job_path, (time_now_ns() - start) / 1e9);
+    } else {
+        remove(tmp);
+    }
+
+    atomic_store(&s->job_done, true);
+    return NULL;
+}
+
+static void spec_job_start(const char* file_path, const char* cache, uint64_t key) {
+    SpecCache* s = &p->spec;
+    snprintf(s->job_path, sizeof(s->job_path), "%s", file_path);
+    snprintf(s->job_cache, sizeof(s->job_cache), "%s", cache);
+    s->job_key = key;
+    atomic_store(&s->job_stop, false);
+    atomic_store(&s->job_done, false);
+
+    // in, windowed, out, bands and the quantized frame
+    da_malloc(s->job_scratch, 6 * FFT_SIZE);
+    s->job_resampler = MALLOC(sizeof(*s->job_resampler));
+
+    if (pthread_create(&s->job, NULL, spec_job_thread, NULL) != 0) {
+        fprintf(stderr, "ERROR: Failed to create thread\n");
+        FREE(s->job_scratch);
+        FREE(s->job_resampler);
+        return;
+    }
+    s->job_running = true;
+}
+
+// Joins a finished job, its cache is mapped right away if the track is still playing, or else the playing track
+// is analyzed next
+static void spec_job_poll(void) {
+    SpecCache* s = &p->spec;
+    if (!s->job_running || !atomic_load(&s->job_done)) return;
+
+    pthread_join(s->job, NULL);
+    s->job_running = false;
+    FREE(s->job_scratch);
+    FREE(s->job_resampler);
+    if (p->cur_track < 0) return;
+
+    const char* file_path = track_get_path(p->cur_track);
+    if (spec_key(file_path) == s->job_key) {
+        spec_map(s->job_cache, s->job_key);
+    } else if (s->data == NULL) {
+        spec_open(file_path);  // The track started while the job was busy, its turn is now
+    }
+}
+
+static void spec_job_stop(void) {
+    SpecCache* s = &p->spec;
+    if (!s->job_running) return;
+
+    atomic_store(&s->job_stop, true);
+    pthread_join(s->job, NULL);
+    s->job_running = false;
+    FREE(s->job_scratch);
+    FREE(s->job_resampler);
+}
+
+/* Waveform Overview */
+#undef MEM_TAG
+#define MEM_TAG MEM_UI
+static uint64_t peaks_key(const char* file_path) {
+    uint32_t config[] = {PEAKS_VERSION, PEAKS_BASE};
+    return cache_key(file_path, config, sizeof(config));
+}
+
+// Bucket count of every level, returns the size of all levels in bytes
+static size_t peaks_layout(uint64_t frame_count, uint32_t base, size_t counts[PEAKS_MAX_LEVELS], uint32_t* level_count) {
+    size_t count = frame_count > 0 ? (frame_count + base - 1) / base : 1;
+    size_t size = 0;
+    uint32_t level = 0;
+    for (;;) {
+        counts[level] = count;
+        size += 2 * count;
+        level += 1;
+        if (count == 1 || level == PEAKS_MAX_LEVELS) break;
+        count = (count + 1) / 2;
+    }
+    *level_count = level;
+    return size;
+}
+
+static bool peaks_map(const char* cache, uint64_t key) {
+    size_t size = 0;
+    unsigned char* data = file_map(cache, &size);
+    if (data == NULL) return false;
+
+    const PeaksHeader* h = (const PeaksHeader*)data;
+    size_t counts[PEAKS_MAX_LEVELS];
+    uint32_t level_count = 0;
+    bool valid = size >= sizeof(*h) && memcmp(h->magic, PEAKS_MAGIC, sizeof(h->magic)) == 0 &&
+                 h->version == PEAKS_VERSION && h->key == key && h->base > 0 &&
+                 size >= sizeof(*h) + peaks_layout(h->frame_count, h->base, counts, &level_count) &&
+                 h->level_count == level_count;
+    if (!valid) {
+        fprintf(stderr, "ERROR: Ignoring the invalid waveform cache %s\n", cache);
+        munmap(data, size);
+        return false;
+    }
+
+    peaks_unmap();
+    Peaks* pk = &p->peaks;
+    pk->data = data;
+    pk->size = size;
+    size_t offset = sizeof(*h);
+    for (uint32_t level = 0; level < level_count; ++level) {
+        pk->levels[level] = (const int8_t*)(data + offset);
+        pk->counts[level] = counts[level];
+        offset += 2 * counts[level];
+    }
+    return true;
+}
+
+static void peaks_unmap(void) {
+    Peaks* pk = &p->peaks;
+    if (pk->data != NULL) munmap(pk->data, pk->size);
+    pk->data = NULL;
+    pk->size = 0;
+}
+
+static void peaks_open(const char* file_path) {
+    peaks_unmap();
+
+    char cache[PATH_MAX];
+    uint64_t key = peaks_key(file_path);
+    if (key == 0 || !cache_path(cache, sizeof(cache), key, PEAKS_CACHE_EXT)) return;
+    if (peaks_map(cache, key)) return;
+    if (!p->peaks.job_running) peaks_job_start(file_path, cache, key);
+}
+
+// One column per pixel from the coarsest level with at least a bucket per pixel, O(pixels) for any track length
+static void peaks_render(Rectangle boundary, float progress) {
+    Peaks* pk = &p->peaks;
+    if (pk->data == NULL || boundary.width < 1.0f) return;
+
+    const PeaksHeader* h = (const PeaksHeader*)pk->data;
+    int width = boundary.width;
+    double frames_per_px = (double)h->frame_count / width;
+
+    uint32_t level = 0;
+    while (level + 1 < h->level_count && (double)((uint64_t)h->base << (level + 1)) <= frames_per_px) level += 1;
+    const int8_t* buckets = pk->levels[level];
+    size_t count = pk->counts[level];
+    double buckets_per_px = frames_per_px / ((uint64_t)h->base << level);
+
+    float mid = boundary.y + boundary.height / 2;
+    float scale = boundary.height / 2 * TIMELINE_WAVE_PERCENT / 127.0f;
+    for (int x = 0; x < width; ++x) {
+        size_t b0 = x * buckets_per_px;
+        size_t b1 = (x + 1) * buckets_per_px;
+        if (b1 <= b0) b1 = b0 + 1;
+        if (b1 > count) b1 = count;
+
+        int lo = INT8_MAX, hi = INT8_MIN;
+        for (size_t b = b0; b < b1; ++b) {
+            lo = buckets[2 * b] < lo ? buckets[2 * b] : lo;
+            hi = buckets[2 * b + 1] > hi ? buckets[2 * b + 1] : hi;
+        }
+        if (lo > hi) continue;
+
+        Color c = boundary.x + x < progress ? COLOR_TIMELINE_WAVE_PLAYED : COLOR_TIMELINE_WAVE;
+        DrawRectangle(boundary.x + x, mid - hi * scale, 1, fmaxf((hi - lo) * scale, 1.0f), c);
+    }
+}
+
+// Decodes the whole file with LoadWave(), the one copy of the track the job holds, and reads it once in its decoded
+// format into the finest level. Every coarser level is folded from the one below it, straight into the mapped file
+static void* peaks_job_thread(void* arg) {
+    (void)arg;
+    sched_apply(SCHED_ROLE_BACKGROUND);
+    Peaks* pk = &p->peaks;
+    uint64_t start = time_now_ns();
+
+    Wave wave = LoadWave(pk->job_path);
+    if (!IsWaveReady(wave)) {
+        atomic_store(&pk->job_done, true);
+        return NULL;
+    }
+
+    PeaksHeader header = {
+        .magic = PEAKS_MAGIC,
+        .version = PEAKS_VERSION,
+        .key = pk->job_key,
+        .frame_count = wave.frameCount,
+        .sample_rate = wave.sampleRate,
+        .base = PEAKS_BASE,
+    };
+    size_t counts[PEAKS_MAX_LEVELS];
+    size_t size = sizeof(header) + peaks_layout(header.frame_count, header.base, counts, &header.level_count);
+
+    char tmp[PATH_MAX + 4];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", pk->job_cache);
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    unsigned char* out = MAP_FAILED;
+    if (fd >= 0 && ftruncate(fd, size) == 0) out = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (fd >= 0) close(fd);
+    if (out == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Could not create %s\n", tmp);
+        remove(tmp);
+        UnloadWave(wave);
+        atomic_store(&pk->job_done, true);
+        return NULL;
+    }
+    memcpy(out, &header, sizeof(header));
+
+    // Finest level, the samples are read in the decoded format without converting the whole track to floats
+    int8_t* level = (int8_t*)(out + sizeof(header));
+    size_t samples_per_bucket = (size_t)PEAKS_BASE * wave.channels;
+    size_t sample_count = (size_t)wave.frameCount * wave.channels;
+    for (size_t b = 0; b < counts[0] && !atomic_load(&pk->job_stop); ++b) {
+        size_t s0 = b * samples_per_bucket;
+        size_t s1 = s0 + samples_per_bucket < sample_count ? s0 + samples_per_bucket : sample_count;
+        int lo = 0, hi = 0;
+        for (size_t i = s0; i < s1; ++i) {
+            int v;
+            switch (wave.sampleSize) {
+            case 8: v = ((const unsigned char*)wave.data)[i] - 128; break;
+            case 16: v = ((const short*)wave.data)[i] / 256; break;
+            default: v = Clamp(((const float*)wave.data)[i], -1.0f, 1.0f) * INT8_MAX; break;
+            }
+            lo = v < lo ? v : lo;
+            hi = v > hi ? v : hi;
+        }
+        level[2 * b] = lo < -INT8_MAX ? -INT8_MAX : lo;
+        level[2 * b + 1] = hi;
+    }
+    UnloadWave(wave);
+
+    for (uint32_t k = 1; k < header.level_count; ++k) {
+        int8_t* next = level + 2 * counts[k - 1];
+        for (size_t b = 0; b < counts[k]; ++b) {
+            size_t c = 2 * b + 1 < counts[k - 1] ? 2 * b + 1 : 2 * b;
+            next[2 * b] = level[4 * b] < level[2 * c] ? level[4 * b] : level[2 * c];
+            next[2 * b + 1] = level[4 * b + 1] > level[2 * c + 1] ? level[4 * b + 1] : level[2 * c + 1];
+        }
+        level = next;
+    }
+
+    bool ok = !atomic_load(&pk->job_stop);
+    ok = munmap(out, size) == 0 && ok;
+    ok = ok && rename(tmp, pk->job_cache) == 0;
+    if (ok) {
+        printf("INFO: Waveform of %s ready in %.3f s\n", pk->job_path, (time_now_ns() - start) / 1e9);
+    } else {
+        remove(tmp);
+    }
+
+    atomic_store(&pk->job_done, true);
+    return NULL;
+}
+
+static void peaks_job_start(const char* file_path, const char* cache, uint64_t key) {
+    Peaks* pk = &p->peaks;
+    snprintf(pk->job_path, sizeof(pk->job_path), "%s", file_path);
+    snprintf(pk->job_cache, sizeof(pk->job_cache), "%s", cache);
+    pk->job_key = key;
+    atomic_store(&pk->job_stop, false);
+    atomic_store(&pk->job_done, false);
+
+    if (pthread_create(&pk->job, NULL, peaks_job_thread, NULL) != 0) {
+        fprintf(stderr, "ERROR: Failed to create thread\n");
+        return;
+    }
+    pk->job_running = true;
+}
+
+// Joins a finished job, its waveform shows up right away if the track is still playing, or else the playing track
+// is scanned next
+static void peaks_job_poll(void) {
+    Peaks* pk = &p->peaks;
+    if (!pk->job_running || !atomic_load(&pk->job_done)) return;
+
+    pthread_join(pk->job, NULL);
+    pk->job_running = false;
+    if (p->cur_track < 0) return;
+
+    const char* file_path = track_get_path(p->cur_track);
+    if (peaks_key(file_path) == pk->job_key) {
+        peaks_map(pk->job_cache, pk->job_key);
+    } else if (pk->data == NULL) {
+        peaks_open(file_path);  // The track started while the job was busy, its turn is now
+    }
+}
 
-    static bool scroll = false;
-    static float scroll_offset = 0.0f;
+static void peaks_job_stop(void) {
+    Peaks* pk = &p->peaks;
+    if (!pk->job_running) return;
 
-    size_t track_count = p->tracks.count;
-    float tracks_offset = (3 * HUD_ICON_MARGIN_BASE + 2 * HUD_ICON_SIZE_BASE) * boundary.height / BASE_HEIGHT;
-    float scroll_w = boundary.width * SCROLL_PERCENT - HUD_EDGE_WIDTH;
-    float item_size = boundary.width * TRACK_ITEM_PERCENT;
-    float scrollable_area = item_size * track_count;
+    atomic_store(&pk->job_stop, true);
+    pthread_join(pk->job, NULL);
+    pk->job_running = false;
+}
 
-    static float panel_velocity = 0.0f;
-    if (CheckCollisionPointRec(mouse, boundary))
-        panel_velocity = panel_velocity * VELOCITY_DECAY + GetMouseWheelMove() * item_size * 8;
+/* Offline Analysis */
+#undef MEM_TAG
+#define MEM_TAG MEM_FFT
+// stdout may carry the bands, so raylib only gets to say something on stderr and only when it matters
+static void analyze_log(int level, const char* text, va_list args) {
+    if (level < LOG_WARNING) return;
+    vfprintf(stderr, text, args);
+    fputc('\n', stderr);
+}
 
-    float max_scroll = scrollable_area - boundary.height + tracks_offset;
-    static float panel_scroll = 0.0f;
-    panel_scroll -= panel_velocity * dt;
+// Runs the same analysis as the visualizer over the whole file, out_path NULL means stdout
+static bool analyze_file(const char* in_path, const char* out_path, size_t hop, bool csv) {
+    uint64_t start = time_now_ns();
 
-    if (scroll)
-        panel_scroll = (mouse.y - boundary.y - tracks_offset - scroll_offset) / (boundary.height + tracks_offset) * scrollable_area;
-    if (panel_scroll < 0) panel_scroll = 0;
-    if (max_scroll < 0) max_scroll = 0;
-    if (panel_scroll > max_scroll) panel_scroll = max_scroll;
+    Wave wave = LoadWave(in_path);
+    if (!IsWaveReady(wave)) {
+        fprintf(stderr, "ERROR: Could not decode %s\n", in_path);
+        return false;
+    }
+    WaveFormat(&wave, ANALYSIS_RATE, 32, wave.channels);  // Same bands as the live analysis
+    float* samples = LoadWaveSamples(wave);
+    unsigned int channels = wave.channels;
+    unsigned int rate = wave.sampleRate;
+    size_t frame_count = wave.frameCount / hop;
+    UnloadWave(wave);
+
+    FILE* out = out_path != NULL ? fopen(out_path, csv ? "w" : "wb") : stdout;
+    if (out == NULL) {
+        fprintf(stderr, "ERROR: Could not open %s\n", out_path);
+        UnloadWaveSamples(samples);
+        return false;
+    }
 
-    BeginScissorMode(boundary.x, boundary.y, boundary.width, boundary.height);
-    {
-        ClearBackground(COLOR_TRACK_PANEL_BACKGROUND);
+    // The band edges only depend on the bin width, they are stepped the same way as in fft_reduce()
+    float* edges;
+    da_malloc(edges, p->analysis->freq_count);
+    size_t band_count = 0;
+    for (float f = LOW_FREQ; (size_t)f < FFT_SIZE / 2; f = ceilf(f * FREQ_STEP)) {
+        edges[band_count++] = f * rate / FFT_SIZE;
+    }
 
-        music_options_render(boundary, p->mode & MODE_REPEAT1 ? MODE_REPEAT1 : MODE_REPEAT, 0);  // Draw repeat
-        music_options_render(boundary, MODE_SHUFFLE, 1);                                         // Draw shuffle
-        music_control_render(boundary, TRACK_PREV, 0);                                           // Draw prev
-        music_control_render(boundary, music_is_playing() ? TRACK_PAUSE : TRACK_PLAY, 1);        // Draw pause
-        music_control_render(boundary, TRACK_NEXT, 2);                                           // Draw next
+    if (csv) {
+        fprintf(out, "frame,time");
+        for (size_t b = 0; b < band_count; ++b) fprintf(out, ",%.2f", edges[b]);
+        fputc('\n', out);
+    } else {
+        AnalyzeHeader header = {
+            .magic = ANALYZE_MAGIC,
+            .version = ANALYZE_VERSION,
+            .fft_size = FFT_SIZE,
+            .sample_rate = rate,
+            .hop = hop,
+            .band_count = band_count,
+            .frame_count = frame_count,
+        };
+        fwrite(&header, sizeof(header), 1, out);
+        fwrite(edges, sizeof(edges[0]), band_count, out);
+    }
+    FREE(edges);
 
-        Rectangle tracks_boundary = {boundary.x, boundary.y + tracks_offset, boundary.width, boundary.height - tracks_offset};
-        BeginScissorMode(tracks_boundary.x, tracks_boundary.y, tracks_boundary.width, tracks_boundary.height);
-        {
-            handle_scroll(tracks_boundary, &scroll, &scroll_offset, &panel_velocity, scrollable_area, scroll_w, panel_scroll, item_size);
-            tracks_render(tracks_boundary, item_size, scroll_w, panel_scroll);
+    fft_clean();
+    size_t n = hop < FFT_SIZE ? hop : FFT_SIZE;
+    for (size_t i = 0; i < frame_count; ++i) {
+        // Slide the window by a whole hop at once, what hop calls of fft_push() would do
+        size_t end = (i + 1) * hop;
+        memmove(p->audio->in_raw, p->audio->in_raw + n, (FFT_SIZE - n) * sizeof(p->audio->in_raw[0]));
+        for (size_t j = 0; j < n; ++j) {
+            p->audio->in_raw[FFT_SIZE - n + j] = samples[(end - n + j) * channels];
         }
-        EndScissorMode();
 
-        Vector2 edge_start_pos = {boundary.x, boundary.y + tracks_offset};
-        Vector2 edge_end_pos = {boundary.x + boundary.width, edge_start_pos.y};
-        DrawLineEx(edge_start_pos, edge_end_pos, HUD_EDGE_WIDTH, COLOR_TRACK_BUTTON_BACKGROUND);
+        fft_analyze(p->audio->in_raw, p->analysis->in_windowed, p->analysis->out_raw, p->analysis->out_logscaled);
+
+        if (csv) {
+            // Stamped like out_pos, the middle of the window
+            fprintf(out, "%zu,%.6f", i, (end > FFT_SIZE / 2 ? end - FFT_SIZE / 2 : 0) / (double)rate);
+            for (size_t b = 0; b < band_count; ++b) fprintf(out, ",%.6f", p->analysis->out_logscaled[b]);
+            fputc('\n', out);
+        } else {
+            fwrite(p->analysis->out_logscaled, sizeof(p->analysis->out_logscaled[0]), band_count, out);
+        }
+    }
+    UnloadWaveSamples(samples);
+
+    bool ok = !ferror(out);
+    if (out != stdout) ok = fclose(out) == 0 && ok;
+    else ok = fflush(out) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "ERROR: Could not write the bands of %s\n", in_path);
+        return false;
     }
-    EndScissorMode();
 
-    Vector2 edge_start_pos = {boundary.x + boundary.width, boundary.y};
-    Vector2 edge_end_pos = {edge_start_pos.x, boundary.y + boundary.height};
-    DrawLineEx(edge_start_pos, edge_end_pos, HUD_EDGE_WIDTH, COLOR_TRACK_BUTTON_BACKGROUND);
+    double secs = (time_now_ns() - start) / 1e9;
+    double audio_secs = (double)frame_count * hop / rate;
+    fprintf(stderr, "INFO: %s: %zu frames in %.3f s (%.0fx realtime)\n", in_path, frame_count, secs,
+            secs > 0 ? audio_secs / secs : 0.0);
+    return true;
 }
 
-/* Music Control UI renderer */
-static void music_options_loc(const char* file, int line, Rectangle boundary, PlayMode icon, int icon_pos) {
-    uint64_t id = djb2_id(file, line);
+static int analyze_name_cmp(const void* a, const void* b) {
+    return strcmp(((const AnalyzeName*)a)->name, ((const AnalyzeName*)b)->name);
+}
 
-    int icon_cnt = 2;
-    int total_icon_cnt = 3;
-    int icon_id = icon > MODE_REPEAT1 ? icon - MODE_REPEAT1 : icon - MODE_REPEAT;  // Get to 0, 1, 2
+// The workers would overwrite each other's output on the same name. Runs before the state exists, so plain malloc()
+static bool analyze_names_unique(char** files, size_t count, const char* out_dir, bool csv) {
+    AnalyzeName* names = malloc(count * sizeof(*names));
+    assert(names != NULL && "ERROR: Not enough RAM");
+    for (size_t i = 0; i < count; ++i) {
+        names[i] = (AnalyzeName){.name = strdup(GetFileNameWithoutExt(files[i])), .file = i};
+        assert(names[i].name != NULL && "ERROR: Not enough RAM");
+    }
+    qsort(names, count, sizeof(names[0]), analyze_name_cmp);
+
+    bool unique = true;
+    for (size_t i = 1; i < count && unique; ++i) {
+        if (strcmp(names[i - 1].name, names[i].name) != 0) continue;
+        fprintf(stderr, "ERROR: %s and %s would both be written to %s/%s.%s, rename one or analyze them apart\n",
+                files[names[i - 1].file], files[names[i].file], out_dir, names[i].name, csv ? "csv" : "mvb");
+        unique = false;
+    }
 
-    float icon_margin = HUD_ICON_MARGIN_BASE * boundary.height / BASE_HEIGHT;
-    float icon_size = HUD_ICON_SIZE_BASE * boundary.height / BASE_HEIGHT;
+    for (size_t i = 0; i < count; ++i) free(names[i].name);
+    free(names);
+    return unique;
+}
 
-    float gap_size = (boundary.width - HUD_EDGE_WIDTH - icon_cnt * icon_size) / (icon_cnt + 1);
-    float btn_x = boundary.x + icon_pos * icon_size + (icon_pos + 1) * gap_size;
+static void analyze_worker(AnalyzeQueue* q, char** files, size_t count, const char* out_dir, size_t hop, bool csv) {
+    char out_path[PATH_MAX];
+    for (size_t i; (i = atomic_fetch_add(&q->next, 1)) < count;) {
+        const char* path = NULL;
+        if (out_dir != NULL) {
+            snprintf(out_path, sizeof(out_path), "%s/%s.%s", out_dir, GetFileNameWithoutExt(files[i]), csv ? "csv" : "mvb");
+            path = out_path;
+        }
+        if (!analyze_file(files[i], path, hop, csv)) atomic_fetch_add(&q->failed, 1);
+    }
+}
 
-    Color c = COLOR_HUD_BTN_BACKGROUND;
-    Rectangle btn = {btn_x, boundary.y + icon_margin, icon_size, icon_size};
+/* Offline Rendering */
+#undef MEM_TAG
+#define MEM_TAG MEM_UI
+// draw_texture_from_endpoints() with the smear uniforms
+static void render_quad_from_endpoints(RenderQuads* qs, float x, float start_y, float end_y, float radius, Color c) {
+    RenderQuad q = {.dest = {x - radius, start_y, 2 * radius, end_y - start_y}, .v0 = 0.5f, .v1 = 1.0f, .radius = 0.3f, .power = 2.0f, .c = c};
+    if (end_y < start_y) {
+        q.dest.y = end_y;
+        q.dest.height = start_y - end_y;
+        q.v0 = 0.0f;
+        q.v1 = 0.5f;
+    }
+    da_append(qs, q);
+}
 
-    if (p->mode & icon) {
-        c = COLOR_HUD_BTN_HOVEROVER;
-        Rectangle rec = {btn.x - icon_margin / 2, btn.y - icon_margin / 2, btn.width + icon_margin, btn.height + icon_margin};
-        DrawRectangleRounded(rec, 0.3, 20, COLOR_TRACK_BUTTON_SELECTED);
+// The primitives fft_render() draws, in the same order and with the whole frame as the boundary, returns the cell width
+static float render_quads_build(RenderQuads* qs, float w, float h) {
+    qs->count = 0;
+
+    float cell_width = w / p->analysis->freq_count;
+    Color c = ColorFromHSV(170, HSV_SATURATION, HSV_VALUE);
+    for (size_t i = 0; i < p->analysis->freq_count; ++i) {
+        float t_smooth = p->analysis->out_smoothed[i];
+        float t_smear = p->analysis->out_smeared[i];
+        float radius = 3 * cell_width * sqrtf(t_smooth);
+
+        float x = i * cell_width + cell_width / 2;
+        float start_t = h / 2 - h / 3 * t_smooth;
+        float start_b = h / 2 + h / 3 * t_smooth;
+
+        // Bars
+        da_append(qs, ((RenderQuad){.dest = {x - cell_width / 2, start_t, cell_width, h / 2 - start_t}, .c = c}));
+        da_append(qs, ((RenderQuad){.dest = {x - cell_width / 2, h / 2, cell_width, start_b - h / 2}, .c = c}));
+
+        // Smear
+        float smear_radius = cell_width * sqrtf(t_smooth);
+        render_quad_from_endpoints(qs, x, start_t, h / 2 - h / 3 * t_smear, smear_radius, c);
+        render_quad_from_endpoints(qs, x, start_b, h / 2 + h / 3 * t_smear, smear_radius, c);
+
+        // Circles
+        da_append(qs, ((RenderQuad){.dest = {x - radius, start_t - radius, 2 * radius, 2 * radius}, 0.0f, 1.0f, 0.15f, 4.0f, c}));
+        da_append(qs, ((RenderQuad){.dest = {x - radius, start_b - radius, 2 * radius, 2 * radius}, 0.0f, 1.0f, 0.15f, 4.0f, c}));
     }
+    return cell_width;
+}
 
-    UIState state = handle_btn(id, btn);
-    if (state == UIS_HOVER) c = COLOR_HUD_BTN_HOVEROVER;
-    if (state == UIS_CLICKED) {
-        if (p->mode & MODE_REPEAT && icon == MODE_REPEAT) {
-            p->mode = (p->mode & ~MODE_REPEAT) | MODE_REPEAT1;
-        } else if (p->mode & MODE_REPEAT1 && icon == MODE_REPEAT) {
-            p->mode = p->mode & ~MODE_REPEAT1;
-        } else {
-            if (p->mode & icon) {
-                p->mode = p->mode & ~icon;
-            } else {
-                p->mode = p->mode | icon;
+// Every tile walks all quads in order, so overlapping quads blend the same as on the GPU
+static void render_tile(Renderer* r, size_t tile) {
+    size_t tiles_x = (r->width + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+    int x0 = tile % tiles_x * RENDER_TILE_SIZE;
+    int y0 = tile / tiles_x * RENDER_TILE_SIZE;
+    int x1 = x0 + RENDER_TILE_SIZE < r->width ? x0 + RENDER_TILE_SIZE : r->width;
+    int y1 = y0 + RENDER_TILE_SIZE < r->height ? y0 + RENDER_TILE_SIZE : r->height;
+
+    Color bg = COLOR_BACKGROUND;
+    size_t row = (size_t)(x1 - x0) * 4;
+    unsigned char* first = &r->pixels[((size_t)y0 * r->width + x0) * 4];
+    for (int x = x0; x < x1; ++x) memcpy(first + (x - x0) * 4, &bg, 4);
+    for (int y = y0 + 1; y < y1; ++y) memcpy(&r->pixels[((size_t)y * r->width + x0) * 4], first, row);
+
+    // Only the bands that can reach into the tile, the bands are ordered from left to right
+    float reach = (RENDER_REACH_CELLS + 0.5f) * r->cell_width + 1.0f;
+    float lo = fmaxf((x0 - reach) / r->cell_width, 0.0f);
+    float hi = fminf((x1 + reach) / r->cell_width + 1.0f, r->quads.count / RENDER_QUADS_PER_BAND);
+    for (size_t i = (size_t)lo * RENDER_QUADS_PER_BAND; i < (size_t)hi * RENDER_QUADS_PER_BAND; ++i) {
+        const RenderQuad* q = &r->quads.items[i];
+        if (!(q->dest.width > 0.0f && q->dest.height > 0.0f)) continue;
+
+        // A pixel belongs to the quad when its center is inside, the same rule the GPU uses
+        int qx0 = fmaxf(x0, ceilf(q->dest.x - 0.5f));
+        int qy0 = fmaxf(y0, ceilf(q->dest.y - 0.5f));
+        int qx1 = fminf(x1, ceilf(q->dest.x + q->dest.width - 0.5f));
+        int qy1 = fminf(y1, ceilf(q->dest.y + q->dest.height - 0.5f));
+        if (qx0 >= qx1 || qy0 >= qy1) continue;
+
+        if (q->power == 0.0f) {
+            for (int y = qy0; y < qy1; ++y) {
+                for (int x = qx0; x < qx1; ++x) memcpy(&r->pixels[((size_t)y * r->width + x) * 4], &q->c, 4);
+            }
+            continue;
+        }
+
+        float cr = q->c.r / 255.0f, cg = q->c.g / 255.0f, cb = q->c.b / 255.0f, ca = q->c.a / 255.0f;
+        for (int y = qy0; y < qy1; ++y) {
+            float v = q->v0 + (y + 0.5f - q->dest.y) / q->dest.height * (q->v1 - q->v0) - 0.5f;
+            for (int x = qx0; x < qx1; ++x) {
+                float u = (x + 0.5f - q->dest.x) / q->dest.width - 0.5f;
+                float len = sqrtf(u * u + v * v);
+                if (len > 0.5f) continue;
+
+                // mix(vec4(c.rgb, 0), c * 1.5, t^power), clamped like a fixed-point target and alpha blended
+                float s = len - q->radius;
+                float k = s <= 0.0f ? 1.0f : powf(1.0f - s / (0.5f - q->radius), q->power);
+                float a = fminf(ca * 1.5f * k, 1.0f);
+                float gain = 1.0f + 0.5f * k;
+
+                unsigned char* px = &r->pixels[((size_t)y * r->width + x) * 4];
+                px[0] = fminf(cr * gain, 1.0f) * a * 255.0f + px[0] * (1.0f - a);
+                px[1] = fminf(cg * gain, 1.0f) * a * 255.0f + px[1] * (1.0f - a);
+                px[2] = fminf(cb * gain, 1.0f) * a * 255.0f + px[2] * (1.0f - a);
             }
         }
     }
+}
 
-    draw_icon(MUSIC_OPTIONS_IMAGE_FILEPATH, icon_id, total_icon_cnt, btn, c);
+static void render_tiles(Renderer* r) {
+    size_t tiles_x = (r->width + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+    size_t tiles_y = (r->height + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+    for (size_t tile; (tile = atomic_fetch_add(&r->next_tile, 1)) < tiles_x * tiles_y;) {
+        render_tile(r, tile);
+    }
 }
 
-static void music_control_loc(const char* file, int line, Rectangle boundary, MusicControl icon, int icon_pos) {
-    uint64_t id = djb2_id(file, line);
+static void* render_thread(void* arg) {
+    Renderer* r = arg;
+    for (;;) {
+        pthread_barrier_wait(&r->start);
+        if (r->stop) break;
+        render_tiles(r);
+        pthread_barrier_wait(&r->done);
+    }
+    return NULL;
+}
 
-    int icon_cnt = 3;
-    int total_icon_cnt = 4;
-    int icon_id = icon;
+// Rasterizes the current bands into r->pixels with every worker
+static void render_frame(Renderer* r) {
+    r->cell_width = render_quads_build(&r->quads, r->width, r->height);
+    atomic_store(&r->next_tile, 0);
+    pthread_barrier_wait(&r->start);
+    render_tiles(r);
+    pthread_barrier_wait(&r->done);
+}
 
-    float icon_margin = HUD_ICON_MARGIN_BASE * boundary.height / BASE_HEIGHT;
-    float icon_size = HUD_ICON_SIZE_BASE * boundary.height / BASE_HEIGHT;
+/* Hot Reload */
+#undef MEM_TAG
+#define MEM_TAG MEM_PLUG
+// Runs once only the audio callback is left running code of this library. Whatever build comes next finds the
+// playback in the Handoff
+static void reload_save(void) {
+    Handoff* h = &p->handoff;
+    // Plain malloc(), the next build may account memory differently
+    h->tracks = malloc(p->tracks.count * sizeof(*h->tracks));
+    assert((h->tracks != NULL || p->tracks.count == 0) && "ERROR: Not enough RAM");
+    for (size_t i = 0; i < p->tracks.count; ++i) {
+        size_t slot = p->tracks.order[i];
+        TrackFile* file = &p->tracks.files[slot];
+        h->tracks[i] = (HandoffTrack){
+            .music = p->tracks.music[slot],
+            .path = track_get_path(i),
+            .file_data = file->file_data,
+            .file_size = file->file_size,
+        };
+    }
+    h->track_count = p->tracks.count;
+    h->cur_track = p->cur_track;
+    h->paused = p->music_is_paused;
+    h->volume = p->volume;
+
+    // Both halves of the stream buffer full, the longest the device can play on while nothing refills it
+    Music* music = track_get_cur();
+    if (music && IsMusicStreamPlaying(*music)) UpdateMusicStream(*music);
+    for (size_t slot = 0; slot < p->tracks.count; ++slot) {
+        DetachAudioStreamProcessor(p->tracks.music[slot].stream, callback);
+    }
+    p->reload.played = music ? GetMusicTimePlayed(*music) : 0.0f;
+}
 
-    float gap_size = (boundary.width - HUD_EDGE_WIDTH - icon_cnt * icon_size) / (icon_cnt + 1);
-    float btn_x = boundary.x + icon_pos * icon_size + (icon_pos + 1) * gap_size;
+// The previous build had the same layout, its state is taken over as it is
+static void reload_resume(void) {
+    free(p->handoff.tracks);
+    p->handoff.tracks = NULL;
+
+    // The window still holds the audio from before the swap, in_pos skips what the device played meanwhile
+    Music* music = track_get_cur();
+    p->reload.missed = 0.0f;
+    if (music) {
+        float missed = GetMusicTimePlayed(*music) - p->reload.played;
+        if (missed > 0.0f) p->reload.missed = missed;
+        atomic_fetch_add(&p->audio->in_pos, (uint64_t)(p->reload.missed * atomic_load(&p->audio->rate)));
+    }
 
-    Color c = COLOR_HUD_BTN_BACKGROUND;
-    Rectangle btn = {btn_x, boundary.y + 2 * icon_margin + icon_size, icon_size, icon_size};
+    // Nothing pushes samples until the callback is attached again, so the tables are rebuilt before that.
+    // The reloaded code may space the bands differently, only then the analysis starts over
+    BandMap bands;
+    fft_bands_init(&bands);
+    bool same_bands = bands.count == p->analysis->bands.count &&
+                      memcmp(bands.lo, p->analysis->bands.lo, bands.count * sizeof(bands.lo[0])) == 0 &&
+                      memcmp(bands.hi, p->analysis->bands.hi, bands.count * sizeof(bands.hi[0])) == 0;
+    if (!same_bands) {
+        p->analysis->bands = bands;
+        p->analysis->freq_count = bands.count;
+    }
+    // The tables follow the reloaded code either way, the resonators keep their sums while their bins stay put
+    // and a reset requested before the swap stays pending
+    mr_init(&p->analysis->mr, &p->analysis->bands);
+    if (same_bands) {
+        sdft_tables(&p->audio->sdft, &p->analysis->bands);
+    } else {
+        sdft_init(&p->audio->sdft, &p->analysis->bands);
+    }
 
-    UIState state = handle_btn(id, btn);
-    if (state == UIS_HOVER) c = COLOR_HUD_BTN_HOVEROVER;
-    if (state == UIS_CLICKED) {
-        switch (icon) {
-            case TRACK_PREV:
-                track_prev_handle();
-                break;
-            case TRACK_PLAY:
-            case TRACK_PAUSE:
-                music_play_pause();
-                break;
-            case TRACK_NEXT:
-                track_next_handle(true);
-                break;
-        }
+    for (size_t slot = 0; slot < p->tracks.count; ++slot) {
+        AttachAudioStreamProcessor(p->tracks.music[slot].stream, callback);
     }
+    audio_feeder_start();
 
-    draw_icon(MUSIC_CONTROLS_IMAGE_FILEPATH, icon_id, total_icon_cnt, btn, c);
+    pfft_pool_init(&p->analysis->pfft, p->analysis->pfft.threads, FFT_SIZE);
+
+    atomic_store(&p->th_stop, false);
+    if (pthread_create(&p->th, NULL, fft_thread, NULL) != 0) {
+        fprintf(stderr, "ERROR: Failed to create thread\n");
+        exit(EXIT_FAILURE);
+    }
+
+    assets_refresh();
+}
+
+// The previous build laid its state out differently, only its Handoff can be read. A fresh state takes the streams
+// over so the music plays on. The previous state is left behind, nothing here knows how to free it
+static void reload_adopt(Handoff* prev) {
+    fprintf(stderr, "WARNING: The state changed from version %u (%u B) to %u (%zu B), starting from a fresh one\n",
+            prev->version, prev->size, PLUG_STATE_VERSION, sizeof(Plug));
+    plug_init();
+    audio_rate_set(prev->device_rate > 0 ? prev->device_rate : AUDIO_DEVICE_FALLBACK_RATE);
+
+    pthread_mutex_lock(&p->audio_mutex);
+    for (size_t i = 0; i < prev->track_count; ++i) {
+        HandoffTrack* track = &prev->tracks[i];
+        AttachAudioStreamProcessor(track->music.stream, callback);
+        tracks_push(&p->tracks, track->music, track->path, track->file_data, track->file_size);
+        shuffle_add(&p->shuffle);
+    }
+    p->volume = prev->volume;
+    p->music_is_paused = prev->paused;
+    Music* music = track_get_by_id(prev->cur_track);
+    if (music) {
+        p->cur_track = prev->cur_track;
+        shuffle_jump(&p->shuffle, p->tracks.order[p->cur_track]);
+        atomic_store(&p->audio->in_pos, (uint64_t)(GetMusicTimePlayed(*music) * atomic_load(&p->audio->rate)));
+    }
+    pthread_mutex_unlock(&p->audio_mutex);
+
+    if (music) {
+        spec_open(track_get_path(p->cur_track));
+        peaks_open(track_get_path(p->cur_track));
+    }
+
+    p->handoff.reload_ns = prev->reload_ns;
+    p->handoff.swap_ns = prev->swap_ns;
+    free(prev->tracks);
+    prev->tracks = NULL;
+}
+
+// Called on the first frame presented after the reload
+static void reload_report(void) {
+    Handoff* h = &p->handoff;
+    Reload* r = &p->reload;
+    uint64_t now = time_now_ns();
+    printf("INFO: Reload took %.3f ms to the first frame: stop %.3f ms, swap %.3f ms, resume %.3f ms, frame %.3f ms\n",
+           (now - h->reload_ns) / 1e6, (h->swap_ns - h->reload_ns) / 1e6, (r->resume_ns - h->swap_ns) / 1e6,
+           (r->ready_ns - r->resume_ns) / 1e6, (now - r->ready_ns) / 1e6);
+    if (r->missed > 0.0f) printf("INFO: The analysis missed %.3f ms of audio during the reload\n", r->missed * 1e3);
+
+    char msg[POPUP_MSG_CAPACITY];
+    snprintf(msg, sizeof(msg), "%.1f ms to the first frame", (now - h->reload_ns) / 1e6);
+    popups_push(&p->popups, "Reloaded", msg);
+    r->pending = false;
 }
 
 /* Helpers */
+#undef MEM_TAG
+#define MEM_TAG MEM_UI
 static void str_fit_width(char* text, float width, float font_size, float text_pad) {
     size_t original_len = strlen(text);
     int text_w = MeasureText(text, font_size);
@@ -1223,8 +4704,10 @@ static void str_fit_width(char* text, float width, float font_size, float text_p
 }
 
 static char* get_track_name(const char* file_path) {
+    // Room for the "..." str_fit_width() may append, the name only lives until the next frame
     const char* orig = GetFileName(file_path);
-    char* track_name = strdup(orig);
+    char* track_name = arena_alloc(&p->frame, strlen(orig) + 4);
+    strcpy(track_name, orig);
     remove_extension(track_name);
 
     return track_name;
@@ -1257,111 +4740,405 @@ static void load_tracks(FilePathList files) {
             UnloadDirectoryFiles(dir_files);
         } else {
             if (track_exists(files.paths[i])) continue;
-            char* mus_file_path = strdup(files.paths[i]);
-            assert(mus_file_path != NULL && "ERROR: Not enough RAM");
-            track_add(mus_file_path);
+            track_add(files.paths[i]);
         }
     }
 }
 
+// Integer environment variable, fallback when it is unset or not a number
+static long env_long(const char* name, long fallback) {
+    const char* value = getenv(name);
+    if (value == NULL || *value == '\0') return fallback;
+
+    char* end = NULL;
+    long n = strtol(value, &end, 10);
+    if (*end != '\0') {
+        fprintf(stderr, "WARNING: %s=%s is not a number, using %ld\n", name, value, fallback);
+        return fallback;
+    }
+    return n;
+}
+
+// Whether the user acted this frame, without taking a key out of the queue of the next one like GetKeyPressed()
+static bool input_pressed(void) {
+    for (int key = KEY_NULL + 1; key <= KEY_KB_MENU; ++key) {
+        if (IsKeyPressed(key)) return true;
+    }
+    return IsMouseButtonPressed(MOUSE_BUTTON_LEFT) || IsMouseButtonReleased(MOUSE_BUTTON_LEFT);
+}
+
 /* Plugin API */
-void plug_init() {
-    p = malloc(sizeof(*p));
+#undef MEM_TAG
+#define MEM_TAG MEM_FFT
+// Everything that works without a window, an audio device or extra threads
+static void plug_init_state(void) {
+    p = mem_malloc_aligned(MEM_PLUG, sizeof(*p));
     assert(p != NULL && "ERROR: Not enough RAM");
     memset(p, 0, sizeof(*p));
+    mem_account(MEM_PLUG, sizeof(*p), true);
+    p->handoff.version = PLUG_STATE_VERSION;
+    p->handoff.size = sizeof(*p);
+
+    // Apart from the Plug and from each other, every thread writes its own lines
+    p->audio = mem_malloc_aligned(MEM_FFT, sizeof(*p->audio));
+    p->analysis = mem_malloc_aligned(MEM_FFT, sizeof(*p->analysis));
+    p->render = mem_malloc_aligned(MEM_UI, sizeof(*p->render));
+    assert(p->audio != NULL && p->analysis != NULL && p->render != NULL && "ERROR: Not enough RAM");
+    memset(p->audio, 0, sizeof(*p->audio));
+    memset(p->analysis, 0, sizeof(*p->analysis));
+    memset(p->render, 0, sizeof(*p->render));
+
+    p->frame.items = mem_malloc(MEM_UI, FRAME_ARENA_CAPACITY);
+    assert(p->frame.items != NULL && "ERROR: Not enough RAM");
+    p->frame.capacity = FRAME_ARENA_CAPACITY;
 
     // Precaclulate hann window
     for (size_t i = 0; i < FFT_SIZE; ++i) {
         float t = (float)i / (FFT_SIZE - 1);
-        p->hann[i] = 0.5 - 0.5 * cosf(TWO_PI * t);
+        p->analysis->hann[i] = 0.5 - 0.5 * cosf(TWO_PI * t);
     }
 
-    // Precaclulate frequency count
-    for (float f = LOW_FREQ; (size_t)f < FFT_SIZE / 2; f = ceilf(f * FREQ_STEP)) p->freq_count += 1;
+    // Precaclulate the bands and their count
+    fft_bands_init(&p->analysis->bands);
+    p->analysis->freq_count = p->analysis->bands.count;
+    mr_init(&p->analysis->mr, &p->analysis->bands);
+    sdft_init(&p->audio->sdft, &p->analysis->bands);
 
     p->cur_track = -1;
+    p->seek_pending = -1.0f;
     p->volume = 0.5f;
     p->mode = MODE_NONE;
     p->music_is_paused = false;
 
-    p->th_stop = false;
-    pthread_mutex_init(&p->th_mutex, NULL);
+    pthread_mutex_init(&p->analysis->th_mutex, NULL);
+
+    pthread_mutexattr_t audio_mutex_attr;
+    pthread_mutexattr_init(&audio_mutex_attr);
+    pthread_mutexattr_settype(&audio_mutex_attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&p->audio_mutex, &audio_mutex_attr);
+    pthread_mutexattr_destroy(&audio_mutex_attr);
+}
+
+void plug_init() {
+    plug_init_state();
+    sched_load();
+
+    const char* shm_name = getenv(SHM_ENV);
+    if (shm_name != NULL && *shm_name != '\0') shm_export_open(shm_name);
+
+    long fft_threads = env_long(PFFT_THREADS_ENV, 1);
+    if (fft_threads < 1) fft_threads = 1;
+    if (fft_threads > PFFT_MAX_THREADS) fft_threads = PFFT_MAX_THREADS;
+    pfft_pool_init(&p->analysis->pfft, fft_threads, FFT_SIZE);
+    printf("INFO: FFT threads: %ld\n", fft_threads);
+
+    atomic_store(&p->th_stop, false);
     if (pthread_create(&p->th, NULL, fft_thread, NULL) != 0) {
         fprintf(stderr, "ERROR: Failed to create thread\n");
         exit(EXIT_FAILURE);
     }
-    da_malloc(p->out_smeared_buf, p->freq_count);
-    da_malloc(p->out_smoothed_buf, p->freq_count);
 
-    p->circle = LoadShader(NULL, fragment_files[CIRCLE_FRAGMENT]);
-    for (Uniform i = 0; i < COUNT_UNIFORMS; i++) {
-        p->uniform_locs[i] = GetShaderLocation(p->circle, uniform_names[i]);
-    }
+    if (!IsAudioDeviceReady()) audio_device_open();
+    SetAudioStreamBufferSizeDefault(AUDIO_STREAM_BUFFER_FRAMES);
+    audio_feeder_start();
+
+    circle_load();
 }
 
 void plug_clean() {
+    audio_feeder_stop();
+    spec_job_stop();
+    peaks_job_stop();
+    peaks_unmap();
+    pthread_mutex_destroy(&p->audio_mutex);
+    audio_stats_summary();
+
     fft_clean();
 
-    for (size_t i = 0; i < p->tracks.count; ++i) {
-        Track* track = &p->tracks.items[i];
-        DetachAudioStreamProcessor(track->music.stream, callback);
-        UnloadMusicStream(track->music);
-        free(track->file_path);
+    for (size_t slot = 0; slot < p->tracks.count; ++slot) {
+        track_unload(slot);
     }
+    CloseAudioDevice();
 
     UnloadShader(p->circle);
 
     assets_unload();
 
-    p->th_stop = true;
-    pthread_mutex_destroy(&p->th_mutex);
+    atomic_store(&p->th_stop, true);
     pthread_join(p->th, NULL);
-
-    free(p->out_smeared_buf);
-    free(p->out_smoothed_buf);
-
-    da_free(&p->tracks);
+    pfft_pool_free(&p->analysis->pfft);
+    shm_export_close();
+    spec_unmap();
+    pthread_mutex_destroy(&p->analysis->th_mutex);
+
+    if (atomic_load(&p->trace.enabled)) trace_stop(TRACE_JSON_FILEPATH);
+    for (TraceThread th = 0; th < COUNT_TRACE_THREADS; ++th) FREE(p->trace.bufs[th].items);
+    if (atomic_load(&p->rec.active)) rec_stop();
+    FREE(p->rec.samples);
+    FREE(p->rec.sizes);
+
+    FREE(p->audio);
+    FREE(p->analysis);
+    FREE(p->render);
+
+    tracks_free(&p->tracks);
+    da_free(&p->shuffle.order);
+    da_free(&p->shuffle.pos);
     da_free(&p->assets.images);
     da_free(&p->assets.textures);
-    free(p);
+    da_free(&p->frame);
+
+    mem_summary();
+    FREE(p);
 }
 
 Plug* plug_pre_reload(void) {
-    for (size_t i = 0; i < p->tracks.count; ++i) {
-        Track* track = &p->tracks.items[i];
-        DetachAudioStreamProcessor(track->music.stream, callback);
-    }
-
-    UnloadShader(p->circle);
-    assets_unload();
+    p->handoff.reload_ns = time_now_ns();
 
-    p->th_stop = true;
+    // Everything that runs code of this library stops, the audio last so the music keeps playing meanwhile
+    atomic_store(&p->th_stop, true);
     pthread_join(p->th, NULL);
+    // The workers run code of this library, so the pool is rebuilt after the reload
+    size_t fft_threads = p->analysis->pfft.threads;
+    pfft_pool_free(&p->analysis->pfft);
+    p->analysis->pfft.threads = fft_threads;
+
+    spec_job_stop();
+    peaks_job_stop();
+
+    // Event names point into this library, they would dangle after the reload
+    if (atomic_load(&p->trace.enabled)) trace_stop(TRACE_JSON_FILEPATH);
+    if (atomic_load(&p->rec.active)) rec_stop();
+
+    audio_feeder_stop();
+    reload_save();
 
+    p->handoff.swap_ns = time_now_ns();
     return p;
 }
 
 void plug_post_reload(Plug* prev) {
-    p = prev;
-    for (size_t i = 0; i < p->tracks.count; ++i) {
-        Track* track = &p->tracks.items[i];
-        AttachAudioStreamProcessor(track->music.stream, callback);
+    uint64_t resume_ns = time_now_ns();
+    Handoff* handoff = &prev->handoff;
+    if (handoff->version == PLUG_STATE_VERSION && handoff->size == sizeof(Plug)) {
+        p = prev;
+        reload_resume();
+    } else {
+        reload_adopt(handoff);
     }
 
-    p->th_stop = false;
-    for (float f = LOW_FREQ; (size_t)f < FFT_SIZE / 2; f = ceilf(f * FREQ_STEP)) p->freq_count += 1;
-    if (pthread_create(&p->th, NULL, fft_thread, NULL) != 0) {
-        fprintf(stderr, "ERROR: Failed to create thread\n");
-        exit(EXIT_FAILURE);
+    p->reload.resume_ns = resume_ns;
+    p->reload.ready_ns = time_now_ns();
+    p->reload.pending = true;
+}
+
+// musicvis --analyze, no window, no audio device and no analysis thread, every worker is a forked process
+int plug_analyze(int argc, char** argv) {
+    const char* out = NULL;
+    size_t hop = ANALYZE_HOP;
+    bool csv = false;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t jobs = cores > 0 ? (size_t)cores : 1;
+
+    // Input files are gathered at the front of argv
+    char** files = argv;
+    size_t count = 0;
+    for (int i = 0; i < argc; ++i) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            out = argv[++i];
+        } else if (strcmp(argv[i], "--hop") == 0 && i + 1 < argc) {
+            hop = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            jobs = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--csv") == 0) {
+            csv = true;
+        } else if (argv[i][0] == '-') {
+            count = 0;
+            break;
+        } else {
+            files[count++] = argv[i];
+        }
+    }
+    if (count == 0 || hop == 0 || jobs == 0) {
+        fprintf(stderr, "Usage: musicvis --analyze [-o <file|dir>] [--csv] [--hop <samples>] [-j <workers>] <file>...\n");
+        return 1;
     }
 
-    da_realloc(p->out_smeared_buf, p->freq_count);
-    da_realloc(p->out_smoothed_buf, p->freq_count);
+    struct stat st;
+    bool out_is_dir = out != NULL && stat(out, &st) == 0 && S_ISDIR(st.st_mode);
+    if (count > 1 && !out_is_dir) {
+        fprintf(stderr, "ERROR: Several files are written to a directory, pass an existing one with -o <dir>\n");
+        return 1;
+    }
+    if (out_is_dir && !analyze_names_unique(files, count, out, csv)) return 1;
+    if (out == NULL && !csv && isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "ERROR: Refusing to write binary bands to a terminal, redirect stdout or pass -o or --csv\n");
+        return 1;
+    }
 
-    p->circle = LoadShader(NULL, fragment_files[CIRCLE_FRAGMENT]);
-    for (Uniform i = 0; i < COUNT_UNIFORMS; i++) {
-        p->uniform_locs[i] = GetShaderLocation(p->circle, uniform_names[i]);
+    SetTraceLogCallback(analyze_log);
+    plug_init_state();
+
+    AnalyzeQueue* q = mmap(NULL, sizeof(*q), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    assert(q != MAP_FAILED && "ERROR: Not enough RAM");
+    atomic_store(&q->next, 0);
+    atomic_store(&q->failed, 0);
+
+    size_t workers = 1;
+    if (out_is_dir) {
+        // The files are handed out one at a time, so long and short ones balance across the workers
+        size_t target = jobs < count ? jobs : count;
+        fflush(NULL);
+        for (; workers < target; ++workers) {
+            pid_t pid = fork();
+            if (pid < 0) {
+                fprintf(stderr, "ERROR: Could not start worker %zu, continuing with %zu\n", workers, workers);
+                break;
+            }
+            if (pid == 0) {
+                analyze_worker(q, files, count, out, hop, csv);
+                fflush(NULL);
+                _exit(0);
+            }
+        }
+        analyze_worker(q, files, count, out, hop, csv);
+
+        int status;
+        while (wait(&status) > 0) {
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) atomic_fetch_add(&q->failed, 1);
+        }
+    } else if (!analyze_file(files[0], out, hop, csv)) {
+        atomic_fetch_add(&q->failed, 1);
+    }
+
+    size_t failed = atomic_load(&q->failed);
+    if (count > 1) fprintf(stderr, "INFO: Analyzed %zu files with %zu workers, %zu failed\n", count, workers, failed);
+    munmap(q, sizeof(*q));
+
+    da_free(&p->frame);
+    pthread_mutex_destroy(&p->analysis->th_mutex);
+    pthread_mutex_destroy(&p->audio_mutex);
+    FREE(p->audio);
+    FREE(p->analysis);
+    FREE(p->render);
+    FREE(p);
+    return failed > 0 ? 1 : 0;
+}
+
+// musicvis --render, steps the analysis at exactly 1/fps and rasterizes fft_render() on the CPU
+int plug_render(int argc, char** argv) {
+    const char* in_path = NULL;
+    const char* out_path = NULL;
+    int width = RENDER_WIDTH, height = RENDER_HEIGHT, fps = RENDER_FPS;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int jobs = cores > 0 ? cores : 1;
+
+    bool usage = false;
+    for (int i = 0; i < argc; ++i) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            usage |= sscanf(argv[++i], "%dx%d", &width, &height) != 2;
+        } else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+            fps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+        } else if (argv[i][0] == '-' || in_path != NULL) {
+            usage = true;
+        } else {
+            in_path = argv[i];
+        }
+    }
+    if (usage || in_path == NULL || width <= 0 || height <= 0 || fps <= 0 || jobs <= 0) {
+        fprintf(stderr, "Usage: musicvis --render [-o <file>] [--size <w>x<h>] [--fps <n>] [-j <threads>] <file>\n");
+        return 1;
+    }
+    if (out_path == NULL && isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "ERROR: Refusing to write raw frames to a terminal, pipe stdout into an encoder or pass -o\n");
+        return 1;
+    }
+
+    SetTraceLogCallback(analyze_log);
+
+    Wave wave = LoadWave(in_path);
+    if (!IsWaveReady(wave)) {
+        fprintf(stderr, "ERROR: Could not decode %s\n", in_path);
+        return 1;
+    }
+    WaveFormat(&wave, ANALYSIS_RATE, 32, wave.channels);  // Same bands as the live analysis
+    float* samples = LoadWaveSamples(wave);
+    unsigned int channels = wave.channels;
+    unsigned int rate = wave.sampleRate;
+    uint64_t sample_count = wave.frameCount;
+    UnloadWave(wave);
+
+    FILE* out = out_path != NULL ? fopen(out_path, "wb") : stdout;
+    if (out == NULL) {
+        fprintf(stderr, "ERROR: Could not open %s\n", out_path);
+        UnloadWaveSamples(samples);
+        return 1;
+    }
+
+    plug_init_state();
+
+    Renderer r = {.width = width, .height = height};
+    da_malloc(r.pixels, (size_t)width * height * 4);
+    pthread_barrier_init(&r.start, NULL, jobs);
+    pthread_barrier_init(&r.done, NULL, jobs);
+    pthread_t* threads;
+    da_malloc(threads, jobs);
+    for (int i = 1; i < jobs; ++i) {
+        if (pthread_create(&threads[i], NULL, render_thread, &r) != 0) {
+            fprintf(stderr, "ERROR: Failed to create thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    uint64_t start = time_now_ns();
+    uint64_t frame_count = (sample_count * fps + rate - 1) / rate;
+    bool ok = true;
+    for (uint64_t frame = 0; frame < frame_count && ok; ++frame) {
+        // The window is centered on the frame time, the position out_pos stamps on the live spectrum
+        int64_t first = (int64_t)(frame * rate / fps) - FFT_SIZE / 2;
+        for (size_t j = 0; j < FFT_SIZE; ++j) {
+            int64_t k = first + (int64_t)j;
+            p->audio->in_raw[j] = k >= 0 && (uint64_t)k < sample_count ? samples[k * channels] : 0.0f;
+        }
+        fft_analyze(p->audio->in_raw, p->analysis->in_windowed, p->analysis->out_raw, p->analysis->out_logscaled);
+        fft_smooth(1.0f / fps);
+
+        render_frame(&r);
+        ok = fwrite(r.pixels, (size_t)width * height * 4, 1, out) == 1;
+    }
+
+    r.stop = true;
+    pthread_barrier_wait(&r.start);
+    for (int i = 1; i < jobs; ++i) pthread_join(threads[i], NULL);
+    pthread_barrier_destroy(&r.start);
+    pthread_barrier_destroy(&r.done);
+
+    ok = (out != stdout ? fclose(out) : fflush(out)) == 0 && ok;
+    if (ok) {
+        double secs = (time_now_ns() - start) / 1e9;
+        fprintf(stderr, "INFO: %s: %lu frames of %dx%d with %d threads in %.3f s (%.1f fps, %.1fx realtime)\n", in_path,
+                (unsigned long)frame_count, width, height, jobs, secs, secs > 0 ? frame_count / secs : 0.0,
+                secs > 0 ? (double)sample_count / rate / secs : 0.0);
+    } else {
+        fprintf(stderr, "ERROR: Could not write the frames of %s\n", in_path);
     }
+
+    UnloadWaveSamples(samples);
+    FREE(threads);
+    FREE(r.pixels);
+    da_free(&r.quads);
+    da_free(&p->frame);
+    pthread_mutex_destroy(&p->analysis->th_mutex);
+    pthread_mutex_destroy(&p->audio_mutex);
+    FREE(p->audio);
+    FREE(p->analysis);
+    FREE(p->render);
+    FREE(p);
+    return ok ? 0 : 1;
 }
 
 void plug_update(void) {
@@ -1373,14 +5150,47 @@ void plug_update(void) {
     static UIState fullscreen_btn_state = UIS_NONE;
     static bool volume_expanded = false;
 
-    Track* track = track_get_cur();
-
-    // Update music & handle input
-    if (track) {
-        UpdateMusicStream(track->music);
-        SetMusicVolume(track->music, p->volume);
+    prof_begin(PROF_FRAME);
+    prof_begin(PROF_INPUT);
+
+    uint64_t allocs = atomic_load(&p->mem.allocs);
+    arena_reset(&p->frame);
+    float dt = GetFrameTime();
+    bool recording = atomic_load(&p->rec.active);  // The frame that starts a recording is not part of it
+    spec_job_poll();
+    peaks_job_poll();
+    int prev_track = p->cur_track;
+    bool dropped = IsFileDropped();
+    bool input = input_pressed();  // EndDrawing() polls the input of the next frame
+
+    Music* music = track_get_cur();
+
+    if (IsKeyPressed(KEY_PROFILER)) {
+        // Rings belong to the threads that run their stages, so they are not touched from here
+        atomic_fetch_add(&p->prof.epoch, 1);
+        p->prof.enabled = !p->prof.enabled;
+    }
+    if (IsKeyPressed(KEY_PROFILER_DUMP)) prof_dump(PROF_CSV_FILEPATH);
+    if (IsKeyPressed(KEY_LATENCY)) latency_toggle();
+    if (IsKeyPressed(KEY_ENGINE)) fft_engine_next();
+    if (IsKeyPressed(KEY_RECORD)) {
+        if (atomic_load(&p->rec.active)) {
+            rec_stop();
+        } else {
+            rec_start(REC_FILEPATH);
+        }
+    }
+    if (IsKeyPressed(KEY_TRACE)) {
+        if (atomic_load(&p->trace.enabled)) {
+            trace_stop(TRACE_JSON_FILEPATH);
+        } else {
+            trace_start();
+        }
+    }
 
-        if (!IsMusicStreamPlaying(track->music) && !p->music_is_paused) {
+    // Handle input, the music stream is refilled by the audio feeder thread
+    if (music) {
+        if (!IsMusicStreamPlaying(*music) && !p->music_is_paused) {
             if (next_timer > 0.0f) {
                 next_timer -= GetFrameTime();
             } else {
@@ -1404,26 +5214,31 @@ void plug_update(void) {
         load_tracks(files);
         UnloadDroppedFiles(files);
 
-        if (track_get_cur() == NULL && p->tracks.count > 0) {
-            PlayMusicStream(p->tracks.items[0].music);
-            p->music_is_paused = false;
-            p->cur_track = 0;
-        }
+        if (track_get_cur() == NULL && p->tracks.count > 0) track_play(0);
     }
+    prof_end(PROF_INPUT);
 
     // Render UI
     BeginDrawing();
     {
         ClearBackground(COLOR_BACKGROUND);
 
-        if (track) {
+        if (music) {
             // fft_proccess(GetFrameTime());
             Rectangle preview_size = calculate_preview();
 
             BeginScissorMode(preview_size.x, preview_size.y, preview_size.width, preview_size.height);
             {
+                prof_begin(PROF_FFT_RENDER);
                 fft_render(preview_size);
+                prof_end(PROF_FFT_RENDER);
+                // Input handling may have grown the track arrays since music was fetched, like timeline_render()
+                Music* cur = track_get_cur();
+                if (p->latency.enabled && cur) latency_update(cur);
+
+                prof_begin(PROF_POPUPS_RENDER);
                 popups_render(&p->popups, preview_size, GetFrameTime());
+                prof_end(PROF_POPUPS_RENDER);
             }
             EndScissorMode();
 
@@ -1431,8 +5246,13 @@ void plug_update(void) {
                 if (fullscreen_btn_state != UIS_HOVER && !volume_expanded) hud_timer -= GetFrameTime();
                 if (fabsf(vec2_sum(GetMouseDelta())) > 0.0f) hud_timer = HUD_TIMER_SECS;
             } else {
+                prof_begin(PROF_TRACKS_PANEL_RENDER);
                 tracks_panel_render(CLITERAL(Rectangle){0, 0, w * PANEL_PERCENT, preview_size.height}, GetFrameTime());
-                timeline_render((CLITERAL(Rectangle){0, preview_size.height, w, h * TIMELINE_PERCENT}), track);
+                prof_end(PROF_TRACKS_PANEL_RENDER);
+
+                prof_begin(PROF_TIMELINE_RENDER);
+                timeline_render((CLITERAL(Rectangle){0, preview_size.height, w, h * TIMELINE_PERCENT}), track_get_cur());
+                prof_end(PROF_TIMELINE_RENDER);
             }
 
             if (hud_timer > 0.0f || !p->fullscreen) {
@@ -1448,10 +5268,27 @@ void plug_update(void) {
             DrawText(msg, w / 2 - width / 2, h / 2 - GENERAL_FONT_SIZE / 2, GENERAL_FONT_SIZE, c);
             popups_render(&p->popups, CLITERAL(Rectangle){.x = 0, .y = 0, .width = w, .height = h}, GetFrameTime());
         }
+
+        if (p->prof.enabled) prof_render(CLITERAL(Rectangle){0, 0, w, h});
+        if (p->latency.enabled && music) latency_render(CLITERAL(Rectangle){0, 0, w, h});
     }
+    prof_begin(PROF_END_DRAWING);
     EndDrawing();
+    prof_end(PROF_END_DRAWING);
+    if (p->reload.pending) reload_report();
+    if (recording && atomic_load(&p->rec.active)) rec_frame(dt);
+
+    // While a track just keeps playing nothing should touch the heap, only user actions may
+    p->mem.frame_allocs = atomic_load(&p->mem.allocs) - allocs;
+    bool steady = music_is_playing() && p->cur_track == prev_track && !dropped && !input;
+    if (steady && p->mem.frame_allocs > 0) {
+        fprintf(stderr, "ERROR: %lu allocations during a steady-state frame\n", (unsigned long)p->mem.frame_allocs);
+#ifdef DEBUG
+        assert(p->mem.frame_allocs == 0 && "ERROR: Steady-state playback must not allocate");
+#endif
+    }
+
+    prof_end(PROF_FRAME);
 }
 
-// TODO: SHUFFLE -> shuffle list instead of playing random song
-// TODO: REPEAT1_SHUFFLE -> play next song instead of stopping
 // TODO: Introduce multithreading
\ No newline at end of file
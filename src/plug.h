@@ -1,12 +1,14 @@
 #ifndef PLUG_H_
 #define PLUG_H_
 
-#define LIST_OF_PLUGS                   \
-    PLUG(plug_init, void, void)         \
-    PLUG(plug_update, void, void)       \
-    PLUG(plug_pre_reload, void*, void)  \
-    PLUG(plug_post_reload, void, void*) \
-    PLUG(plug_clean, void, void)
+#define LIST_OF_PLUGS                    \
+    PLUG(plug_init, void, void)          \
+    PLUG(plug_update, void, void)        \
+    PLUG(plug_pre_reload, void*, void)   \
+    PLUG(plug_post_reload, void, void*)  \
+    PLUG(plug_clean, void, void)         \
+    PLUG(plug_analyze, int, int, char**) \
+    PLUG(plug_render, int, int, char**)
 
 #define PLUG(name, ret, ...) typedef ret(name##_t)(__VA_ARGS__);
 LIST_OF_PLUGS
@@ -0,0 +1,196 @@
+// Replays a session recorded with KEY_RECORD in a hidden window and as fast as possible. The recorded buffers go
+// through callback() and fft_proccess(), then plug_update() runs on the recorded input and frame time.
+// Every frame prints a checksum of the published spectrum, so two builds can be diffed frame by frame.
+// plug.c is compiled into this file, so its static functions can be called directly.
+
+// plug_update() steps its timers by the recorded frame time, not by how long the replay took
+#define GetFrameTime replay_frame_time
+
+#include "plug.c"
+
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+static uint64_t fnv1a(const void* data, size_t size, uint64_t hash) {
+    const unsigned char* bytes = data;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static float replay_dt = 0.0f;
+
+float replay_frame_time(void) {
+    return replay_dt;
+}
+
+static bool read_exact(FILE* f, void* data, size_t size) {
+    return fread(data, 1, size, f) == size;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <session.mvr>\n", argv[0]);
+        return 1;
+    }
+    const char* file_path = argv[1];
+
+    FILE* f = fopen(file_path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: Could not open %s\n", file_path);
+        return 1;
+    }
+
+    RecHeader header;
+    if (!read_exact(f, &header, sizeof(header)) || memcmp(header.magic, REC_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "ERROR: %s is not a session recording\n", file_path);
+        return 1;
+    }
+    if (header.version != REC_VERSION) {
+        fprintf(stderr, "ERROR: %s has version %u, expected %u\n", file_path, header.version, REC_VERSION);
+        return 1;
+    }
+    if (header.fft_size != FFT_SIZE) {
+        printf("INFO: Recorded with FFT_SIZE %u, replaying with %d\n", header.fft_size, FFT_SIZE);
+    }
+
+    SetTraceLogLevel(LOG_WARNING);
+    SetConfigFlags(FLAG_WINDOW_HIDDEN);
+    InitWindow(header.width, header.height, "Music Visualizer Replay");
+    SetExitKey(KEY_NULL);
+    // Only so that the tracks load. callback() is detached from them and sees nothing but the recorded buffers
+    InitAudioDevice();
+    SetMasterVolume(0.0f);
+
+    plug_init_state();
+    audio_rate_set(header.sample_rate);
+    p->spec.disabled = true;
+    p->volume = header.volume;
+    p->mode = header.mode;
+    p->fullscreen = header.fullscreen;
+    atomic_store(&p->audio->engine, header.engine);
+    circle_load();
+
+    float(*samples)[2] = NULL;
+    uint32_t samples_capacity = 0;
+
+    uint64_t session_hash = FNV_OFFSET;
+    uint64_t frames = 0, buffers = 0, inputs = 0;
+    uint64_t callback_ns = 0, analysis_ns = 0, analysis_max_ns = 0, update_ns = 0, update_max_ns = 0;
+    uint32_t dropped = 0;
+    bool done = false;
+
+    for (uint32_t i = 0; i < header.track_count; ++i) {
+        uint32_t length;
+        char path[PATH_MAX];
+        if (fgetc(f) != REC_TRACK || !read_exact(f, &length, sizeof(length))) goto truncated;
+        if (length >= sizeof(path) || !read_exact(f, path, length)) goto truncated;
+        path[length] = '\0';
+        track_add(path);
+    }
+    if (p->tracks.count != header.track_count) {
+        fprintf(stderr, "ERROR: Could not load every track of %s\n", file_path);
+        goto fail;
+    }
+    for (size_t slot = 0; slot < p->tracks.count; ++slot) {
+        DetachAudioStreamProcessor(p->tracks.music[slot].stream, callback);
+    }
+    if (header.cur_track >= 0) {
+        track_play(header.cur_track);
+        if (header.paused) music_play_pause();
+    }
+
+    uint64_t start = time_now_ns();
+
+    while (!done) {
+        int type = fgetc(f);
+        switch (type) {
+        case REC_AUDIO: {
+            uint32_t count;
+            if (!read_exact(f, &count, sizeof(count))) goto truncated;
+            if (count > samples_capacity) {
+                samples_capacity = count;
+                da_realloc(samples, samples_capacity);
+            }
+            if (!read_exact(f, samples, count * sizeof(samples[0]))) goto truncated;
+
+            uint64_t t = time_now_ns();
+            callback(samples, count);
+            callback_ns += time_now_ns() - t;
+            buffers += 1;
+        } break;
+
+        case REC_INPUT: {
+            uint32_t count;
+            if (!read_exact(f, &count, sizeof(count))) goto truncated;
+            for (uint32_t i = 0; i < count; ++i) {
+                AutomationEvent event;
+                if (!read_exact(f, &event, sizeof(event))) goto truncated;
+                PlayAutomationEvent(event);
+            }
+            inputs += count;
+        } break;
+
+        case REC_FRAME: {
+            RecFrame frame;
+            if (!read_exact(f, &frame, sizeof(frame))) goto truncated;
+            replay_dt = frame.dt;
+
+            uint64_t t = time_now_ns();
+            fft_proccess(frame.dt);
+            t = time_now_ns() - t;
+            analysis_ns += t;
+            if (t > analysis_max_ns) analysis_max_ns = t;
+
+            AnalysisBlock* a = p->analysis;
+            uint64_t hash = fnv1a(a->out_smoothed, a->freq_count * sizeof(a->out_smoothed[0]), FNV_OFFSET);
+            hash = fnv1a(a->out_smeared, a->freq_count * sizeof(a->out_smeared[0]), hash);
+            session_hash = fnv1a(&hash, sizeof(hash), session_hash);
+            dropped = frame.dropped;
+            frames += 1;
+
+            uint64_t u = time_now_ns();
+            plug_update();
+            u = time_now_ns() - u;
+            update_ns += u;
+            if (u > update_max_ns) update_max_ns = u;
+
+            printf("frame %6lu  dt %.5f  spectrum %016lx  analysis %9.3f us  update %9.3f us\n",
+                   (unsigned long)frame.frame, frame.dt, (unsigned long)hash, t / 1e3, u / 1e3);
+        } break;
+
+        case REC_END:
+            done = true;
+            break;
+
+        default:
+            goto truncated;
+        }
+    }
+
+    uint64_t wall_ns = time_now_ns() - start;
+    printf("INFO: %lu frames, %lu audio buffers, %lu input events, %u buffers dropped while recording\n",
+           (unsigned long)frames, (unsigned long)buffers, (unsigned long)inputs, dropped);
+    printf("INFO: Wall %.3f ms, callback %.3f ms, analysis mean %.3f us, max %.3f us\n", wall_ns / 1e6, callback_ns / 1e6,
+           frames > 0 ? analysis_ns / 1e3 / frames : 0.0, analysis_max_ns / 1e3);
+    printf("INFO: Update mean %.3f us, max %.3f us\n", frames > 0 ? update_ns / 1e3 / frames : 0.0,
+           update_max_ns / 1e3);
+    printf("INFO: Session checksum %016lx\n", (unsigned long)session_hash);
+
+    FREE(samples);
+    fclose(f);
+    CloseAudioDevice();
+    CloseWindow();
+    return 0;
+
+truncated:
+    fprintf(stderr, "ERROR: %s is truncated or corrupted after %lu frames\n", file_path, (unsigned long)frames);
+fail:
+    FREE(samples);
+    fclose(f);
+    CloseAudioDevice();
+    CloseWindow();
+    return 1;
+}
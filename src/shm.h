@@ -0,0 +1,81 @@
+#ifndef SHM_H_
+#define SHM_H_
+
+// The live spectrum musicvis exports with MUSICVIS_SHM=<name>. Map the object read-only and read it in place:
+//
+//     uint32_t seq;
+//     do {
+//         seq = shm_read_begin(frame);
+//         ...use frame...
+//     } while (shm_read_retry(frame, seq));
+//
+// The writer never waits for readers, a reader that keeps losing the race falls behind by whole frames only
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SHM_MAGIC "MVS1"
+#define SHM_VERSION 1
+#define SHM_DEFAULT_NAME "/musicvis"
+#define SHM_RING_FRAMES 8
+#define SHM_MAX_BANDS 1024
+#define SHM_READ_ATTEMPTS 64
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2, "Atomics shared between processes have to be lock-free");
+
+typedef struct {
+    _Atomic uint32_t seq;  // Odd while the writer is inside, even and 2 higher after every frame
+    uint32_t band_count;
+    uint64_t frame;        // Sequence number of the spectrum, from 0
+    uint64_t audio_pos;    // Output device frame since the start of the track the spectrum is centered on
+    uint32_t sample_rate;  // Of the output device, audio_pos / sample_rate is the time in the track
+    uint32_t reserved;
+    float bands[SHM_MAX_BANDS];  // Normalized to the loudest band, before smoothing
+    float smoothed[SHM_MAX_BANDS];
+    float smeared[SHM_MAX_BANDS];
+} ShmFrame;
+
+typedef struct {
+    char magic[4];  // Written last, the rest of the header is valid once it matches
+    uint32_t version;
+    uint32_t ring_frames;
+    uint32_t max_bands;
+    _Atomic uint64_t latest;  // Frames published so far, the newest is frames[(latest - 1) % ring_frames]
+    ShmFrame frames[SHM_RING_FRAMES];
+} ShmSpectrum;
+
+static inline uint32_t shm_read_begin(ShmFrame* f) {
+    return atomic_load_explicit(&f->seq, memory_order_acquire);
+}
+
+// True when the writer was inside, or came in, since shm_read_begin() returned seq
+static inline bool shm_read_retry(ShmFrame* f, uint32_t seq) {
+    atomic_thread_fence(memory_order_acquire);
+    return (seq & 1) != 0 || atomic_load_explicit(&f->seq, memory_order_relaxed) != seq;
+}
+
+// Copies the newest frame, false when nothing was published yet or every attempt raced the writer
+static inline bool shm_read_latest(ShmSpectrum* shm, ShmFrame* out) {
+    for (int attempt = 0; attempt < SHM_READ_ATTEMPTS; ++attempt) {
+        uint64_t latest = atomic_load_explicit(&shm->latest, memory_order_acquire);
+        if (latest == 0) return false;
+
+        ShmFrame* f = &shm->frames[(latest - 1) % SHM_RING_FRAMES];
+        uint32_t seq = shm_read_begin(f);
+        uint32_t count = f->band_count < SHM_MAX_BANDS ? f->band_count : SHM_MAX_BANDS;
+        out->band_count = count;
+        out->frame = f->frame;
+        out->audio_pos = f->audio_pos;
+        out->sample_rate = f->sample_rate;
+        memcpy(out->bands, f->bands, count * sizeof(f->bands[0]));
+        memcpy(out->smoothed, f->smoothed, count * sizeof(f->smoothed[0]));
+        memcpy(out->smeared, f->smeared, count * sizeof(f->smeared[0]));
+        if (!shm_read_retry(f, seq)) return true;
+    }
+    return false;
+}
+
+#endif
@@ -0,0 +1,75 @@
+// Reference reader of the spectrum musicvis exports with MUSICVIS_SHM=<name>. Prints a line for every new frame
+// with its audio time and loudest band, and counts the frames it missed. Needs nothing but shm.h.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shm.h"
+
+#define SHMREAD_POLL_NS 1000000  // Far below the refresh rate of the analysis
+#define SHMREAD_BAR_WIDTH 40
+
+int main(int argc, char** argv) {
+    const char* name = argc > 1 ? argv[1] : SHM_DEFAULT_NAME;
+    unsigned long limit = argc > 2 ? strtoul(argv[2], NULL, 10) : 0;  // Frames to print, 0 runs until interrupted
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Could not open shared memory %s: %s\n", name, strerror(errno));
+        fprintf(stderr, "Usage: %s [name] [frames]\n", argv[0]);
+        return 1;
+    }
+    ShmSpectrum* shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Could not map shared memory %s: %s\n", name, strerror(errno));
+        return 1;
+    }
+    if (memcmp(shm->magic, SHM_MAGIC, sizeof(shm->magic)) != 0 || shm->version != SHM_VERSION) {
+        fprintf(stderr, "ERROR: %s is not a musicvis spectrum of version %d\n", name, SHM_VERSION);
+        return 1;
+    }
+
+    static ShmFrame frame;
+    unsigned long frames = 0, missed = 0, retries = 0;
+    uint64_t next = UINT64_MAX;
+    while (limit == 0 || frames < limit) {
+        struct timespec poll = {.tv_nsec = SHMREAD_POLL_NS};
+        uint64_t latest = atomic_load_explicit(&shm->latest, memory_order_acquire);
+        if (latest == 0 || (next != UINT64_MAX && latest <= next)) {  // The newest frame is number latest - 1
+            nanosleep(&poll, NULL);
+            continue;
+        }
+        if (!shm_read_latest(shm, &frame)) {
+            retries += 1;
+            continue;
+        }
+        if (next != UINT64_MAX && frame.frame > next) missed += frame.frame - next;
+        next = frame.frame + 1;
+
+        size_t peak = 0;
+        for (size_t i = 1; i < frame.band_count; ++i) {
+            if (frame.smoothed[i] > frame.smoothed[peak]) peak = i;
+        }
+        char bar[SHMREAD_BAR_WIDTH + 1];
+        size_t len = frame.band_count > 0 ? (size_t)(frame.smoothed[peak] * SHMREAD_BAR_WIDTH) : 0;
+        if (len > SHMREAD_BAR_WIDTH) len = SHMREAD_BAR_WIDTH;
+        memset(bar, '#', len);
+        bar[len] = '\0';
+
+        printf("frame %8lu  audio %9.3f s  bands %4u  peak %4zu %5.3f %s\n", (unsigned long)frame.frame,
+               frame.sample_rate > 0 ? (double)frame.audio_pos / frame.sample_rate : 0.0, frame.band_count, peak,
+               frame.band_count > 0 ? frame.smoothed[peak] : 0.0f, bar);
+        frames += 1;
+    }
+
+    printf("INFO: %lu frames, %lu missed, %lu reads retried\n", frames, missed, retries);
+    munmap(shm, sizeof(*shm));
+    return 0;
+}